@@ -24,6 +24,7 @@
 #include "mm.h"
 #include "memlib.h"
 #include "fcyc.h"
+#include "clock.h"
 #include "config.h"
 #include "stree.h"
 
@@ -35,6 +36,7 @@
 #define MAXLINE     1024          /* max string size */
 #define HDRLINES       4          /* number of header lines in a trace file */
 #define LINENUM(i) (i+HDRLINES+1) /* cnvt trace request nums to linenums (origin 1) */
+#define BATCH_MAX     64          /* max requests replayed by one batch call (-b) */
 
 #ifndef REF_ONLY
 #define REF_ONLY 0
@@ -121,6 +123,7 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    double max_op_secs; /* slowest single malloc/free/realloc (always 0 for libc) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -160,6 +163,7 @@ int verbose = REF_ONLY ? 0 : 1;  /* global flag for verbose output */
 static int errors = 0;           /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
+static bool batch_mode = false;   /* Replay request runs through the batch calls and trim (set by -b) */
 static size_t maxfill = MAXFILL;
 
 /* by default, no timeouts */
@@ -217,7 +221,9 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static int eval_mm_batch_alloc(trace_t *trace, range_set_t *ranges, int opnum);
+static int eval_mm_batch_free(trace_t *trace, range_set_t *ranges, int opnum);
+static double eval_mm_util(trace_t *trace, int tracenum, double *max_op_secs);
 static void eval_mm_speed(void *ptr);
 
 /* Various helper routines */
@@ -283,7 +289,7 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i].max_op_secs);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
@@ -356,7 +362,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hOVlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hOVlDTb")) != EOF) {
         switch (c) {
 
             case 'f': /* Use one specific trace file only (relative to curr dir) */
@@ -406,6 +412,10 @@ int main(int argc, char **argv)
                 tab_mode = true;
                 break;
 
+            case 'b': /* Check mm_malloc_batch, mm_free_batch and mm_trim too */
+                batch_mode = true;
+                break;
+
             case 'h': /* Print this message */
                 usage(argv[0]);
                 exit(0);
@@ -691,9 +701,10 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of one heap (or of one mapped region) */
+    size_t heap_id = mem_heap_of(lo);
+    if ((heap_id == MEM_HEAPS || hi > (char *)mem_heap_hi_at(heap_id)) &&
+        !mem_in_region(lo, hi)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -1031,6 +1042,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     int i;
     int index;
     size_t size;
+    int n;
     char *newp;
     char *oldp;
     char *p;
@@ -1072,6 +1084,14 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             case ALLOC: /* mm_malloc */
 
+                /* With -b, a run of same-sized requests is one mm_malloc_batch */
+                if (batch_mode) {
+                    if ((n = eval_mm_batch_alloc(trace, ranges, i)) == 0)
+                        return false;
+                    i += n - 1;
+                    break;
+                }
+
                 /* Call the student's malloc */
                 if ((p = mm_malloc(size)) == NULL) {
                     malloc_error(trace, i, "mm_malloc failed.");
@@ -1138,6 +1158,15 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 break;
 
             case FREE: /* mm_free */
+
+                /* With -b, a run of frees is one mm_free_batch */
+                if (batch_mode) {
+                    if ((n = eval_mm_batch_free(trace, ranges, i)) == 0)
+                        return false;
+                    i += n - 1;
+                    break;
+                }
+
                 if (!check_index(trace, i, index, 0))
                     return false;
 
@@ -1159,19 +1188,94 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     return true;
 }
 
+/*
+ * eval_mm_batch_alloc - Serve the run of ALLOC requests of one size that
+ *   starts at request opnum (at most BATCH_MAX of them) with a single
+ *   mm_malloc_batch call, and check each block like mm_malloc's.
+ *   Returns the number of requests served, 0 on error.
+ */
+static int eval_mm_batch_alloc(trace_t *trace, range_set_t *ranges, int opnum)
+{
+    void *blocks[BATCH_MAX];
+    size_t size = trace->ops[opnum].size;
+    int n = 0;
+    int j;
+
+    while (n < BATCH_MAX && opnum + n < trace->num_ops &&
+           trace->ops[opnum + n].type == ALLOC &&
+           trace->ops[opnum + n].size == size)
+        n++;
+
+    if (mm_malloc_batch(size, n, blocks) != (size_t) n) {
+        malloc_error(trace, opnum, "mm_malloc_batch failed.");
+        return 0;
+    }
+
+    for (j = 0; j < n; j++) {
+        int index = trace->ops[opnum + j].index;
+        if (add_range(ranges, blocks[j], size, trace, opnum + j, index) == 0)
+            return 0;
+        trace->blocks[index] = blocks[j];
+        trace->block_sizes[index] = size;
+        randomize_block(trace, index);
+    }
+    return n;
+}
+
+/*
+ * eval_mm_batch_free - Free the run of FREE requests that starts at request
+ *   opnum (at most BATCH_MAX of them) with a single mm_free_batch call,
+ *   then trim the heap completely. The blocks still allocated keep their
+ *   data, which check_index verifies later. Returns the number of requests
+ *   served, 0 on error.
+ */
+static int eval_mm_batch_free(trace_t *trace, range_set_t *ranges, int opnum)
+{
+    void *blocks[BATCH_MAX];
+    int n = 0;
+
+    while (n < BATCH_MAX && opnum + n < trace->num_ops &&
+           trace->ops[opnum + n].type == FREE) {
+        int index = trace->ops[opnum + n].index;
+        if (!check_index(trace, opnum + n, index, 0))
+            return 0;
+        if (index == -1) {
+            blocks[n] = NULL;
+        } else {
+            blocks[n] = trace->blocks[index];
+            remove_range(ranges, blocks[n]);
+        }
+        n++;
+    }
+
+    mm_free_batch(blocks, n);
+
+    /* Give the whole free top of the heap back, the heap must stay consistent */
+    mm_trim(0);
+    if (!mm_checkheap(0)) {
+        malloc_error(trace, opnum, "mm_checkheap returned false after mm_trim\n");
+        return 0;
+    }
+    return n;
+}
+
 /*
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
  *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   package on the trace. Note that mem_sbrk() lets the package
+ *   decrement the brk pointer, so the heap size is sampled after every
+ *   request and its maximum is used as the high water mark. Regions
+ *   mapped with mem_map() count towards the heap size.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   Each request is also timed on its own, and the slowest one is
+ *   returned in max_op_secs so worst-case latency bounds can be checked.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, double *max_op_secs)
 {
     int i;
     int index;
@@ -1182,8 +1286,10 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     size_t heap_size = 0;
     char *p;
     char *newp, *oldp;
+    double op_secs;
 
     reinit_trace(trace);
+    *max_op_secs = 0;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
@@ -1191,6 +1297,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
 
     for (i = 0;  i < trace->num_ops;  i++) {
+        start_timer();
         switch (trace->ops[i].type) {
 
             case ALLOC: /* mm_alloc */
@@ -1247,10 +1354,16 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                           tracenum);
         }
 
+        /* update the worst-case request latency */
+        op_secs = get_timer();
+        *max_op_secs = (op_secs > *max_op_secs) ? op_secs : *max_op_secs;
+
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
-        heap_size = mem_heapsize();
+        heap_size = mem_mapsize();
+        for (size_t heap_id = 0; heap_id < MEM_HEAPS; heap_id++)
+            heap_size += mem_heapsize_at(heap_id);
         max_heap_size = (heap_size > max_heap_size) ?
             heap_size : max_heap_size;
     }
@@ -1440,10 +1553,10 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
 
     /* Print the individual results for each trace */
     if (tab_mode) {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\tmaxus\ttrace\n");
     } else {
-        printf("  %5s  %6s %7s%8s%8s  %s\n",
-               "valid", "util", "ops", "msecs", "Kops", "trace");
+        printf("  %5s  %6s %7s%8s%8s%9s  %s\n",
+               "valid", "util", "ops", "msecs", "Kops", "maxus", "trace");
     }
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
@@ -1506,6 +1619,13 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
 
+            /* Worst-case single request latency (usecs) */
+            if (tab_mode) {
+                printf("%.2f\t", stats[i].max_op_secs * 1e6);
+            } else {
+                printf("%8.2f ", stats[i].max_op_secs * 1e6);
+            }
+
             printf("%s\n", stats[i].filename);
 
             if (stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1522,15 +1642,16 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
         }
         else {
             if (tab_mode) {
-                printf("no\t\t\t\t\t\t\t%s\n", stats[i].filename);
+                printf("no\t\t\t\t\t\t\t\t%s\n", stats[i].filename);
             } else {
-                printf("%2s%4s%7s%10s%7s%10s %s\n",
+                printf("%2s%4s%7s%10s%7s%10s%9s %s\n",
                        stats[i].weight != 0 ? "*" : "",
                        "no",
                        "-",
                        "-",
                        "-",
                        "-",
+                       "-",
                        stats[i].filename);
             }
         }
@@ -1796,7 +1917,7 @@ static double measure_ref_throughput() {
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlVdDb] [-f <file>]\n", prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
     fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1808,5 +1929,6 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-b         Check runs of requests through mm_malloc_batch/mm_free_batch, and mm_trim\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
@@ -4,6 +4,7 @@
  * package with the system's malloc package in libc.
  *
  */
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -14,6 +15,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -23,6 +25,21 @@ static unsigned char *heap;                 /* Starting address of heap */
 static unsigned char *mem_brk;              /* Current position of break */
 static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
 
+/* Heaps 1 to MEM_HEAPS - 1, one HEAP_SPAN slice of the reserved space each (heap 0 is heap/mem_brk) */
+#define HEAP_SPAN (MAX_HEAP_SIZE / MEM_HEAPS)
+static unsigned char *heap_brks[MEM_HEAPS]; /* Current position of each heap's break */
+
+/* Regions mapped outside the heap with mem_map */
+typedef struct {
+    unsigned char *addr;                    /* Start of the region (page aligned) */
+    size_t size;                            /* Length in bytes (page aligned) */
+} region_t;
+static region_t *regions;                   /* Live regions, in no particular order */
+static size_t num_regions;                  /* Number of live regions */
+static size_t max_regions;                  /* Capacity of regions */
+static size_t mapped_size;                  /* Total bytes in live regions */
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards the region list */
+
 /* 
  * mem_init - initialize the memory system model
  */
@@ -38,7 +55,7 @@ void mem_init(){
 	exit(1);
     }
     heap = addr;
-    mem_max_addr = addr + MAX_HEAP_SIZE;
+    mem_max_addr = addr + HEAP_SPAN;
     mem_reset_brk();
 }
 
@@ -50,27 +67,38 @@ void mem_deinit(void){
         fprintf(stderr, "FAILURE.  munmap couldn't deallocate heap space\n");
         exit(1);
     }
+    mem_reset_brk();
+    free(regions);
+    regions = NULL;
+    max_regions = 0;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make every heap
+ *		empty, and unmap every region left over from mem_map
  */
 void mem_reset_brk(){
+    size_t i;
     mem_brk = heap;
+    for (i = 1; i < MEM_HEAPS; i++)
+	heap_brks[i] = heap + i * HEAP_SPAN;
+    while (num_regions > 0)
+	mem_unmap(regions[0].addr, regions[0].size);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area. A
+ *		negative incr shrinks the heap by -incr bytes (returning them to
+ *		the model), but never below its start.
  */
 void *mem_sbrk(intptr_t incr) {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0) {
+    if (incr < 0 && (size_t) -incr > (size_t) (mem_brk - heap)) {
 	ok = false;
-	fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
+	fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld bytes below its start\n", (long) -incr);
     } else if (mem_brk + incr > mem_max_addr) {
 	ok = false;
 	long alloc = mem_brk - heap + incr;
@@ -85,6 +113,174 @@ void *mem_sbrk(intptr_t incr) {
     }
 }
 
+/*
+ * mem_sbrk_at - mem_sbrk on heap number id (heap 0 is the one mem_sbrk
+ *		extends). Each heap is a disjoint slice of the reserved space
+ *		with its own break, so separate heaps never need a common lock.
+ */
+void *mem_sbrk_at(size_t id, intptr_t incr) {
+    if (id == 0)
+	return mem_sbrk(incr);
+
+    unsigned char *lo = heap + id * HEAP_SPAN;
+    unsigned char *old_brk = heap_brks[id];
+    if (incr < 0 && (size_t) -incr > (size_t) (old_brk - lo)) {
+	fprintf(stderr, "ERROR: mem_sbrk_at failed.  Attempt to shrink heap %zu by %ld bytes below its start\n", id, (long) -incr);
+    } else if (old_brk + incr > lo + HEAP_SPAN) {
+	fprintf(stderr, "ERROR: mem_sbrk_at failed. Ran out of memory in heap %zu\n", id);
+    } else {
+	heap_brks[id] += incr;
+	return (void *) old_brk;
+    }
+    errno = ENOMEM;
+    return (void *) -1;
+}
+
+/*
+ * mem_purge - release the pages of [addr, addr + len) back to the OS.
+ *		addr and len must be page aligned. The pages stay mapped and read
+ *		back as zero.
+ */
+bool mem_purge(void *addr, size_t len) {
+    if (madvise(addr, len, MADV_DONTNEED) != 0) {
+	fprintf(stderr, "ERROR: mem_purge failed. madvise on %p (%zu bytes) returned %d\n", addr, len, errno);
+	return false;
+    }
+    return true;
+}
+
+/*
+ * mem_map - map a new region of size bytes (a multiple of the page size)
+ *		outside the heap. Returns its start address, or NULL on error.
+ */
+void *mem_map(size_t size) {
+    pthread_mutex_lock(&regions_lock);
+    if (num_regions == max_regions) {
+	size_t new_max = max_regions ? 2 * max_regions : 16;
+	region_t *new_regions = realloc(regions, new_max * sizeof(region_t));
+	if (new_regions == NULL) {
+	    fprintf(stderr, "ERROR: mem_map failed. Out of region slots\n");
+	    pthread_mutex_unlock(&regions_lock);
+	    return NULL;
+	}
+	regions = new_regions;
+	max_regions = new_max;
+    }
+
+    unsigned char *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map failed. mmap of %zu bytes returned %d\n", size, errno);
+	pthread_mutex_unlock(&regions_lock);
+	return NULL;
+    }
+    regions[num_regions].addr = addr;
+    regions[num_regions].size = size;
+    num_regions++;
+    mapped_size += size;
+    pthread_mutex_unlock(&regions_lock);
+    return (void *) addr;
+}
+
+/*
+ * find_region - return the index of the region starting at addr, or
+ *		num_regions if there is none
+ */
+static size_t find_region(const void *addr) {
+    size_t i;
+    for (i = 0; i < num_regions; i++)
+	if (regions[i].addr == addr)
+	    break;
+    return i;
+}
+
+/*
+ * mem_unmap - unmap a region returned by mem_map (or mem_remap)
+ */
+bool mem_unmap(void *addr, size_t size) {
+    bool ok = false;
+    pthread_mutex_lock(&regions_lock);
+    size_t i = find_region(addr);
+    if (i == num_regions || regions[i].size != size) {
+	fprintf(stderr, "ERROR: mem_unmap failed. %p (%zu bytes) is not a mapped region\n", addr, size);
+    } else if (munmap(addr, size) != 0) {
+	fprintf(stderr, "ERROR: mem_unmap failed. munmap returned %d\n", errno);
+    } else {
+	mapped_size -= size;
+	regions[i] = regions[--num_regions];
+	ok = true;
+    }
+    pthread_mutex_unlock(&regions_lock);
+    return ok;
+}
+
+/*
+ * mem_remap - resize a region returned by mem_map to new_size bytes (a
+ *		multiple of the page size). The region may move; its pages
+ *		are moved, not copied. Returns the new start address, or NULL
+ *		on error (the old region is left untouched).
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+    unsigned char *new_addr = NULL;
+    pthread_mutex_lock(&regions_lock);
+    size_t i = find_region(addr);
+    if (i == num_regions || regions[i].size != old_size) {
+	fprintf(stderr, "ERROR: mem_remap failed. %p (%zu bytes) is not a mapped region\n", addr, old_size);
+    } else if ((new_addr = mremap(addr, old_size, new_size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_remap failed. mremap to %zu bytes returned %d\n", new_size, errno);
+	new_addr = NULL;
+    } else {
+	mapped_size = mapped_size - old_size + new_size;
+	regions[i].addr = new_addr;
+	regions[i].size = new_size;
+    }
+    pthread_mutex_unlock(&regions_lock);
+    return (void *) new_addr;
+}
+
+/*
+ * mem_move_pages - move the pages of [src, src + len) to [dst, dst + len)
+ *		inside the heap without copying them (the ranges must not
+ *		overlap, addresses and len must be page aligned). The source
+ *		range reads back as zero afterwards. Returns false, with both
+ *		ranges untouched, when the pages cannot be moved; the caller
+ *		copies them instead.
+ */
+bool mem_move_pages(void *dst, void *src, size_t len) {
+    if (mremap(src, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, dst) == MAP_FAILED)
+	return false;
+
+    /* mremap leaves a hole at src, map fresh pages there to keep the heap contiguous */
+    if (mmap(src, len, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+	fprintf(stderr, "FAILURE.  mmap couldn't refill the heap at %p after mem_move_pages\n", src);
+	exit(1);
+    }
+    return true;
+}
+
+/*
+ * mem_in_region - return whether [lo, hi] lies inside one mapped region
+ */
+bool mem_in_region(const void *lo, const void *hi) {
+    bool found = false;
+    size_t i;
+    pthread_mutex_lock(&regions_lock);
+    for (i = 0; i < num_regions && !found; i++)
+	if ((const unsigned char *) lo >= regions[i].addr &&
+	    (const unsigned char *) hi < regions[i].addr + regions[i].size)
+	    found = true;
+    pthread_mutex_unlock(&regions_lock);
+    return found;
+}
+
+/*
+ * mem_mapsize() - returns the total size of the mapped regions in bytes
+ */
+size_t mem_mapsize() {
+    return mapped_size;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -106,6 +302,32 @@ size_t mem_heapsize() {
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_heap_lo_at, mem_heap_hi_at, mem_heapsize_at - the same for heap id
+ */
+void *mem_heap_lo_at(size_t id) {
+    return (void *) (heap + id * HEAP_SPAN);
+}
+
+void *mem_heap_hi_at(size_t id) {
+    return (void *) ((id == 0 ? mem_brk : heap_brks[id]) - 1);
+}
+
+size_t mem_heapsize_at(size_t id) {
+    return (size_t) ((id == 0 ? mem_brk : heap_brks[id]) - (heap + id * HEAP_SPAN));
+}
+
+/*
+ * mem_heap_of - return the id of the heap whose slice holds addr, or
+ *		MEM_HEAPS when addr is outside every heap
+ */
+size_t mem_heap_of(const void *addr) {
+    const unsigned char *p = addr;
+    if (p < heap || p >= heap + MEM_HEAPS * HEAP_SPAN)
+	return MEM_HEAPS;
+    return (size_t) (p - heap) / HEAP_SPAN;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -2,13 +2,29 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* The heap space is split into MEM_HEAPS disjoint heaps with a break each. mem_sbrk, mem_heap_lo,
+   mem_heap_hi and mem_heapsize work on heap 0, the *_at versions on any heap */
+#define MEM_HEAPS 16
+
 void mem_init();               
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
+void *mem_sbrk_at(size_t id, intptr_t incr);
 void mem_reset_brk(void); 
+bool mem_purge(void *addr, size_t len);
+void *mem_map(size_t size);
+bool mem_unmap(void *addr, size_t size);
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
+bool mem_move_pages(void *dst, void *src, size_t len);
+bool mem_in_region(const void *lo, const void *hi);
+size_t mem_mapsize(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+void *mem_heap_lo_at(size_t id);
+void *mem_heap_hi_at(size_t id);
+size_t mem_heapsize_at(size_t id);
+size_t mem_heap_of(const void *addr);
 size_t mem_pagesize(void);
 
 /* Functions used for memory emulation */
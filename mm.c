@@ -7,29 +7,126 @@
  *
  *                                       MALLOC DESIGN DESCRIPTION
  * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
- * In this first implimentation, I decided to create a LIFO explicit free list memory allocator.
- * I decided to go this route so that I could understand the basics of making an explicit free
- * list before I move forward and change to a segregated free list to increase memory utilazation.
+ * The first implimentation was a single LIFO explicit free list. It has since been changed to a segregated
+ * free list: NUM_CLASSES explicit LIFO lists, one per power of two size range (class 0 holds the 16 byte mini
+ * blocks, class 1 holds [32, 64) bytes and so on, the last class holds everything larger). Each list is circular and
+ * doubly linked through a sentinel node (just a pred and a succ link) that stands for its root, so linking
+ * and unlinking a block are the same four stores whether or not it is first, last or alone, with no NULL
+ * checks. The array of sentinels is not a global; it lives at the very start of the heap, below the prologue
+ * block.
  * 
- * In Malloc, the free list is always searched for a suitable block before adding the block to the top
- * of the heap. When searching, this allocator uses a first fit system.
+ * In Malloc, the free lists are always searched for a suitable block before adding the block to the top
+ * of the heap. The search starts at the size class of the request and only moves up to larger classes, so
+ * it never touches blocks that are too small. A 64 bit bitmap (class_map) mirrors which classes are
+ * non-empty, so the first non-empty larger class is found with one find-first-set. FIT_POLICY picks how a
+ * class is searched: first fit tries the root of the request's own class, then the root of the first
+ * non-empty larger class, and only walks its own class when nothing larger exists. Best fit takes the
+ * tightest block of the first class with a fit, and good fit (the default) the tightest of the first
+ * GOOD_FIT_CANDIDATES fits, which keeps most of best fit's utilization at a bounded cost: in its own class it
+ * looks at no more than FIT_SCAN (twice GOOD_FIT_CANDIDATES) blocks before it falls back to the first larger
+ * class, whose blocks all fit.
+ * 
+ * Building with TLSF=1 switches the lists to a two-level segregated fit: the first level is the power of two
+ * of the size and each first level is split into SL_COUNT linear second levels, with one bitmap per level
+ * (class_map for the first, a byte per first level stored after the sentinels for the second). find_fit checks
+ * the first TLSF_SCAN blocks of the request's own class, so exact and near fits are reused, and otherwise
+ * rounds the request up to the next second level boundary so the root of any class it finds fits, which
+ * bounds malloc and free to a fixed number of steps. TLSF builds do not purge (PURGE is forced to 0): the
+ * purge walk visits every large free block. Nor do they keep quick lists (QUICK_MAX_BLOCK is forced to 0),
+ * whose consolidation on a miss frees every cached block at once. The header/footer layout and coalesce are
+ * shared by both modes.
  * 
  * I decided to coalesce the free blocks during calls to free. This way, all free blocks are at the 
  * largest size possible before any attempt is made to allocate to them.
  * 
- * Realloc uses the implimentation of malloc to first create a new memory region, then memcopy the memory 
- * from the old block to the new block, depending on its size.
+ * Realloc shrinks a block in place and frees the tail. When a block grows, it tries the options that avoid
+ * a search and keep the peak heap lowest, in order: absorb a free next block, merge with a free previous
+ * block (and a free next block) and slide the payload down, and extend the heap for a block at the top.
+ * Only when none works does it use malloc to create a new memory region, then memcopy the payload over.
+ * A grown block is marked GROWN in its header; when it grows again it reserves 1.5 times the request, so
+ * a buffer grown in small steps only moves or splits O(log n) times. The reserved tail is returned to the
+ * free lists by free (coalesce) and by a realloc that shrinks the block below what the reservation covers.
+ * free clears the bit, so a block recycled through a quick list starts out unmarked, and mapped blocks are
+ * never marked (mem_remap resizes them without a tail).
+ * 
+ * When no free block is found and the allocator must aquire more memory from the OS, grow_heap extends the
+ * heap with a single mem_sbrk call by exactly the shortfall: the block size minus the free block already at
+ * the top of the heap (which the new page coalesces with). The heap also shrinks: once free leaves more than
+ * TRIM_THRESHOLD bytes free at the top, mm_trim gives all but TRIM_PAD of them back with a negative mem_sbrk.
+ * Large free blocks inside the heap cannot be given back that way, so coalesce stamps every free block of at
+ * least PURGE_THRESHOLD bytes with the request count, and every PURGE_INTERVAL requests the ones that stayed
+ * free for PURGE_DECAY requests have their page aligned interior released with mem_purge (madvise) and get
+ * the PURGED header bit. place passes the bit on to the remainder, so hot blocks are not purged again, and
+ * notes the part of the allocated block that still reads zero, which calloc then does not clear.
+ * 
+ * Requests of MMAP_THRESHOLD bytes or more bypass the heap entirely: map_block gives each one its own memlib
+ * region, marked by the MAPPED bit at the top of the header. free unmaps it at once and realloc resizes it
+ * with mem_remap (mremap), so huge buffers neither fragment the heap nor raise its high-water mark. A large
+ * heap block (REMAP_THRESHOLD or more) that realloc must move to the top of the heap is placed at the same page
+ * offset, so move_to_top moves its whole pages with mem_move_pages and only copies the partial pages.
+ * 
+ * Building with THREAD_SAFE=1 makes the allocator safe to call from several threads. The heap is split into
+ * NUM_ARENAS arenas, each in its own memlib heap (a disjoint slice of the address space) with its own free
+ * lists, top of heap and lock; the arena struct sits at the start of its heap. A thread gets a home arena
+ * round robin on its first malloc and allocates from it. A block belongs to the arena whose heap holds its
+ * address, so free and realloc find the owner without a header field. The public functions take the arena's
+ * lock around heap_malloc, heap_free and heap_realloc, which hold the single threaded code.
+ * A thread freeing a block of another arena does not take that arena's lock: remote_free pushes the block onto
+ * the owner's remote free queue, a lock free multi producer stack, and the owner's next malloc takes the whole
+ * queue with one atomic exchange and frees the batch under the lock it already holds.
+ * Each thread also keeps its own cache of small freed blocks: one LIFO bin per block size up to
+ * TCACHE_MAX_BLOCK. Cached blocks stay marked allocated, so malloc and free can pop and push them without a
+ * lock. Only a full or empty bin takes a lock, to flush or refill a whole batch at once, and a thread's bins
+ * are flushed when it exits. On x86-64 Linux (RSEQ_CACHE) the bins are per CPU instead, so their number
+ * follows the cores rather than the threads: cpu_cache_pop and cpu_cache_push are restartable sequences
+ * (rseq) that the kernel restarts if the thread is preempted or migrated before their final store, so they
+ * need neither a lock nor an atomic instruction. Without a registered rseq area the thread caches are used.
+ * 
+ * Requests of SLAB_MAX_SIZE bytes or less (single threaded builds) skip the boundary tags altogether: they get a
+ * slot in a slab run, a RUN_SIZE byte block split into equal slots of one size with a bitmap of the free ones,
+ * so a slot has no header and freeing it sets one bit. The runs come from a separate slab arena in its
+ * own memlib heap through find_fit and place. Every block there is one run, so the runs stay on a RUN_SIZE grid
+ * and free finds a slot's run (and tells a slot from a block) with address arithmetic alone. Runs with free
+ * slots are kept on one list per slot size. An empty run goes back to the slab arena at once, which trims its
+ * free top completely, so memory the small requests no longer use can serve the main heap.
+ * 
+ * Freed blocks of at most QUICK_MAX_BLOCK bytes skip coalescing: they go on the arena's quick list for their
+ * exact size still marked allocated, so a malloc of that size pops one without find_fit or place. Before the
+ * heap would grow, allocate_block consolidates the quick lists (frees and coalesces every block on them) and
+ * searches the free lists again, and mm_trim does the same, so the cached blocks never cost heap growth.
+ * 
+ * With DEFERRED_COALESCING, larger blocks are not coalesced by free either: they wait, still marked allocated, in
+ * the arena's pending buffer. When it fills up, or when malloc finds no fit, flush_pending sorts it by address
+ * and frees each run of adjacent pending blocks as one block, so neighbours freed close together cost one
+ * coalesce and one free list insert instead of one each.
+ * 
+ * Building with TREE_MIN_BLOCK set keeps the free blocks of at least that many bytes out of the lists, in a
+ * splay tree keyed by (size, address) whose left and right links take the place of pred and succ. Large
+ * requests get the lower bound of (size, NULL) in it: the best fit, and the lowest addressed block among
+ * equal sizes. The splay is top down, so the nodes need no parent link.
  * 
- * When no free block is found and the allocator must aquire more memory from the OS, it does so in a page 
- * granularity of 1 MiB. In the final submission, this value will change based on maximal throughput/memory util
+ * Only free blocks carry a footer. Every header keeps the allocated state of the previous block in its
+ * PREV_ALLOC bit, which is all coalesce needs to know about the block before it, so an allocated block
+ * costs just its 8 byte header.
+ * 
+ * The pred and succ links of a free block are 32 bit offsets from the start of its arena's heap in 16 byte
+ * units (the arena, and so every block and sentinel, is 16 byte aligned), which reach the whole 64 GB heap
+ * slice. Both fit the 8 byte payload of a 16 byte mini block (what requests of 8 bytes or less get), so free
+ * mini blocks are on a size class list like any other. A mini block has no room for a footer; the block after
+ * a mini block has its PREV_MINI header bit set instead, which prev_blk uses in place of the footer.
  * 
  * Placing blocks in a free block is done through the place function. This function allocatees a block at the given
- * address. In place, it check to see if the remainder is smaller than the minimum block size (32 bytes); if so, it 
+ * address. In place, it check to see if the remainder is smaller than the mini block size (16 bytes); if so, it 
  * allocates the whole free block, otherwise it splices the block and places the unused bytes at the begining of the 
- * free list.
+ * free list of their size class.
  * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=--=
  */
 
+/* Thread safe build: arenas with a lock each and per thread caches of small freed blocks */
+#ifndef THREAD_SAFE
+#define THREAD_SAFE 0
+#endif
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,6 +135,22 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <math.h>
+#if THREAD_SAFE
+#include <pthread.h>
+#endif
+
+/* Per CPU caches on restartable sequences (x86-64 Linux, glibc 2.35 or later registers each thread's rseq area) */
+#ifndef RSEQ_CACHE
+#if THREAD_SAFE && defined(__x86_64__) && defined(__linux__) && __has_include(<sys/rseq.h>)
+#define RSEQ_CACHE 1
+#else
+#define RSEQ_CACHE 0
+#endif
+#endif
+
+#if RSEQ_CACHE
+#include <sys/rseq.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -76,27 +189,371 @@
 /* What is the correct alignment?*/
 #define ALIGNMENT 16
 
+/* free trims the heap once the free block at the top is larger than TRIM_THRESHOLD, keeping TRIM_PAD bytes */
+#define TRIM_THRESHOLD (1 << 17)
+#define TRIM_PAD (1 << 16)
+
+/* Requests of at least MMAP_THRESHOLD bytes get their own memlib region instead of a heap block */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1 << 20)
+#endif
+
+/* A heap block of at least REMAP_THRESHOLD bytes that realloc has to move to the top of the heap is moved
+   by remapping its pages instead of copying its bytes */
+#define REMAP_THRESHOLD (1 << 16)
+
+/* Header bit (above any heap size) marking a block in its own mapped region: header at +8, payload at +16 */
+#define MAPPED ((size_t)1 << 63)
+
+/* Mini block: a header and an 8 byte payload (the pred and succ links when free), the smallest block */
+#define MINI_BLOCK_SIZE 16
+
+/* Header bit set when the previous block is allocated (allocated blocks have no footer) */
+#define PREV_ALLOC 0x2
+
+/* Header bit set when the previous block is a mini block (free mini blocks have no footer either) */
+#define PREV_MINI 0x4
+
+/* Header bit set on an allocated block that realloc has grown, its next growth reserves a geometric tail */
+#define GROWN 0x8
+
+/* The same bit on a free block: its page aligned interior has been purged (known zero and cold). The alloc bit
+   tells the two apart: place drops PURGED when it allocates the block, and free clears GROWN before the block
+   reaches the free lists, where coalesce rewrites the header anyway */
+#define PURGED 0x8
+
+/* Free blocks of at least PURGE_THRESHOLD bytes that stayed free for PURGE_DECAY requests get their pages
+   purged; the free blocks are checked every PURGE_INTERVAL requests */
+#define PURGE_THRESHOLD (1 << 18)
+#define PURGE_DECAY 4096
+#define PURGE_INTERVAL 1024
+
+/* Purging on (1) or off (0). TLSF does not purge, the walk over the large free blocks has no fixed bound */
+#ifndef PURGE
+#define PURGE 1
+#endif
+#if TLSF
+#undef PURGE
+#define PURGE 0
+#endif
+
+/* Fit policy of the size class lists (ignored by TLSF): the first block that fits, the tightest fit in
+   the class, or the tightest of the first GOOD_FIT_CANDIDATES blocks that fit. FIT_SCAN bounds how many
+   blocks of the request's own class are looked at, fitting or not, while a larger class can be used instead */
+#define FIRST_FIT 0
+#define BEST_FIT 1
+#define GOOD_FIT 2
+#ifndef FIT_POLICY
+#define FIT_POLICY GOOD_FIT
+#endif
+#ifndef GOOD_FIT_CANDIDATES
+#define GOOD_FIT_CANDIDATES 8
+#endif
+
+#if FIT_POLICY == BEST_FIT
+#define FIT_CANDIDATES SIZE_MAX
+#define FIT_SCAN SIZE_MAX
+#elif FIT_POLICY == GOOD_FIT
+#define FIT_CANDIDATES GOOD_FIT_CANDIDATES
+#define FIT_SCAN (2 * GOOD_FIT_CANDIDATES)
+#else
+#define FIT_CANDIDATES 1
+#define FIT_SCAN 1
+#endif
+
+/* Allocation mode: 0 = segregated first fit, 1 = two-level segregated fit (TLSF, bounded worst case) */
+#ifndef TLSF
+#define TLSF 0
+#endif
+
+#if TLSF
+/* TLSF: first level is floor(log2(size)), each first level range is split into SL_COUNT equal parts */
+#define SL_LOG2 3
+#define SL_COUNT 8
+#define FL_SHIFT 4 // log2(MINI_BLOCK_SIZE): first level 0 holds [16, 32)
+#define FL_COUNT 36 // Blocks are smaller than MAX_HEAP_SIZE (2^40 bytes)
+#define TLSF_SCAN 8 // Blocks of the request's own class find_fit checks before rounding the request up
+#define NUM_CLASSES (FL_COUNT * SL_COUNT)
+#else
+/* Number of segregated free lists (size classes), at most 64 so the class bitmap fits a word */
+#define NUM_CLASSES 21
+#endif
+
+/* Free blocks of at least TREE_MIN_BLOCK bytes are kept in a splay tree keyed by (size, address) instead of
+   the size class lists, which gives large requests an O(log n) amortized best fit with address ordered ties.
+   0 (the default) disables the tree: on the traces good fit's bounded list walks already find as tight a
+   block, and the splays cost more. TLSF keeps only its lists: its point is a fixed bound on every step */
+#ifndef TREE_MIN_BLOCK
+#define TREE_MIN_BLOCK 0
+#endif
+#if TLSF
+#undef TREE_MIN_BLOCK
+#define TREE_MIN_BLOCK 0
+#endif
+
+/* Bytes at the start of the heap holding the size class list sentinels (and the TLSF second level bitmaps) */
+#define SENTINEL_SIZE 16 // pred and succ, padded to keep the sentinels addressable by a link
+#if TLSF
+#define ROOTS_SIZE (NUM_CLASSES * SENTINEL_SIZE + 48)
+#else
+#define ROOTS_SIZE (NUM_CLASSES * SENTINEL_SIZE)
+#endif
+
+/* Number of arenas, each a separate memlib heap with its own free lists and lock. Threads are given home
+   arenas round robin; a single threaded build has one */
+#if !THREAD_SAFE
+#undef NUM_ARENAS
+#define NUM_ARENAS 1
+#elif !defined(NUM_ARENAS)
+#define NUM_ARENAS 8
+#endif
+#if NUM_ARENAS > MEM_HEAPS
+#error "NUM_ARENAS is larger than the number of memlib heaps"
+#endif
+
+/* Requests of at most SLAB_MAX_SIZE bytes get a slot without a header in a slab run: a RUN_SIZE byte block
+   that the slab arena (its own memlib heap, after the arenas) hands out with find_fit and place, split into
+   equal slots with a bitmap of the free ones. Single threaded builds only, the thread caches cover the rest */
+#ifndef SLAB
+#define SLAB !THREAD_SAFE
+#endif
+#if SLAB && THREAD_SAFE
+#error "SLAB needs a single threaded build"
+#endif
+#define SLAB_MAX_SIZE 128
+#define SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_HEAP NUM_ARENAS
+#ifndef RUN_SIZE
+#define RUN_SIZE 4096
+#endif
+#define RUN_HEADER_SIZE 64 // struct run, rounded up to the alignment
+#define RUN_SLOTS_SIZE (RUN_SIZE - 8 - RUN_HEADER_SIZE)
+#if RUN_SLOTS_SIZE / ALIGNMENT > 256
+#error "A run holds more slots than its free_map has bits"
+#endif
+
+/* Freed blocks of at most QUICK_MAX_BLOCK bytes go on the arena's quick lists, one LIFO list per block size.
+   They stay marked allocated and are not coalesced, so a malloc of the same size pops one right back. The
+   quick lists are consolidated (really freed) before the heap would grow, and by mm_trim */
+#ifndef QUICK_MAX_BLOCK
+#define QUICK_MAX_BLOCK 512
+#endif
+/* TLSF has no quick lists: the malloc that misses would consolidate every cached block, which has no fixed bound */
+#if TLSF
+#undef QUICK_MAX_BLOCK
+#define QUICK_MAX_BLOCK 0
+#endif
+#define QUICK_BINS (QUICK_MAX_BLOCK / ALIGNMENT)
+#if QUICK_BINS > 64
+#error "QUICK_MAX_BLOCK is too large for the quick_map bitmap"
+#endif
+
+/* With DEFERRED_COALESCING, free puts the other blocks in the arena's pending buffer (still marked allocated)
+   instead of coalescing them. The buffer is sorted by address and merged in one pass when it holds
+   PENDING_COUNT blocks or when malloc finds no fit. Off by default: on the traces few pending blocks turn out
+   to be neighbours, so the sort costs more than the coalesces it saves */
+#ifndef DEFERRED_COALESCING
+#define DEFERRED_COALESCING 0
+#endif
+#define PENDING_COUNT 32
+
+#if THREAD_SAFE
+/* Blocks of at most TCACHE_MAX_BLOCK bytes are cached per thread in one LIFO bin per block size, at most
+   TCACHE_COUNT per bin. A full bin gives TCACHE_FLUSH blocks back to the heap and an empty one is refilled
+   with TCACHE_FILL blocks, each under a single acquisition of the heap lock */
+#define TCACHE_MAX_BLOCK 256
+#define TCACHE_BINS (TCACHE_MAX_BLOCK / ALIGNMENT)
+#define TCACHE_COUNT 32
+#define TCACHE_FLUSH 16
+#define TCACHE_FILL 8
+
+/* A thread's cache: bins[i] lists cached blocks of (i + 1) * 16 bytes, linked through their payloads. Cached
+   blocks stay marked allocated, so the arenas never see them */
+struct tcache {
+    char *bins[TCACHE_BINS];
+    uint8_t counts[TCACHE_BINS];
+    bool registered; // The thread exit destructor is set up
+};
+#endif
+
+#if RSEQ_CACHE
+/* One bin of a CPU's cache: a stack of count blocks. The rseq code below hard codes this layout (count at
+   offset 0, slots at offset 8) */
+struct cpu_bin {
+    size_t count;
+    char *slots[TCACHE_COUNT];
+};
+#endif
+
+/* An arena: the free lists and top of one memlib heap, with a lock of its own. The size class list
+   sentinels sit at the start of its heap (INVARIANT: an empty list's sentinel links to itself both ways) */
+struct arena {
+    char *sentinels; // Sentinels of the circular segregated free lists, SENTINEL_SIZE bytes apart
+    char *TOH; // Next free payload pointer of the never allocated heap area
+    size_t op_clock; // Number of malloc and free requests so far, free blocks are stamped with it
+    uint64_t class_map; // Bit i is set when size class i is non-empty (TLSF: when first level i is non-empty)
+#if TREE_MIN_BLOCK
+    char *tree_root; // Root of the splay tree of large free blocks, NULL when empty
+#endif
+    size_t id; // memlib heap holding the arena
+#if QUICK_BINS
+    char *quick_lists[QUICK_BINS]; // Quick lists, linked through the payloads
+    uint64_t quick_map; // Bit i is set when quick list i is non-empty
+#endif
+#if DEFERRED_COALESCING
+    char *pending[PENDING_COUNT]; // Freed blocks waiting to be coalesced, in free order
+    size_t pending_count;
+#endif
+#if PURGE
+    char *zero_lo; // Page aligned range of the block place last took from a purged block that still reads zero,
+    char *zero_hi; // for heap_calloc (which resets both to NULL first)
+#endif
+#if THREAD_SAFE
+    pthread_mutex_t lock; // Held around every use of the arena
+    char *remote_frees; // Lock free stack of blocks freed by threads of other arenas, linked through the payloads
+#endif
+};
+
+/* Bytes at the start of each heap taken by its arena (a multiple of the alignment) */
+#define ARENA_SIZE ((sizeof(struct arena) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT)
+
+#if SLAB
+/* Header of a slab run, at the start of its payload and followed by its slots */
+struct run {
+    struct run *next; // Runs of the same slot size with a free slot (doubly linked)
+    struct run *prev;
+    uint32_t slot_size;
+    uint32_t free_count;
+    uint64_t free_map[4]; // Bit i is set when slot i is free
+};
+#endif
+
 // Prototypes
+static bool arena_init(size_t id);
+static void* heap_malloc(size_t size);
+static void heap_free(void* payload_pointer);
+static void* heap_realloc(void* oldptr, size_t size);
+static void* heap_calloc(size_t size);
+static bool trim_heap(size_t pad);
+static size_t heap_malloc_batch(size_t size, size_t n, void** out);
+static void heap_free_batch(void** ptrs, size_t n);
+static int compare_addresses(const void* a, const void* b);
+static void* allocate_block(size_t block_size);
+static void free_block(void* payload_pointer, size_t size);
+#if QUICK_BINS
+static size_t quick_bin(size_t block_size);
+static void consolidate_quick_lists(void);
+#endif
+#if DEFERRED_COALESCING
+static void flush_pending(void);
+#endif
+#if SLAB
+static bool is_slab(void* payload_pointer);
+static struct run *run_of(void* payload_pointer);
+static void* slab_malloc(size_t size);
+static void slab_free(void* payload_pointer);
+static void* slab_realloc(void* oldptr, size_t size);
+static struct run *new_run(size_t class);
+static void release_run(struct run *run);
+static void unlink_run(struct run *run);
+#endif
 static bool allocate_page(size_t page_size);
-static size_t pack(size_t size, int alloc);
+static bool grow_heap(size_t block_size);
+static void* map_block(size_t size);
+static void* remap_block(void* payload_pointer, size_t size);
+static void* move_to_top(void* payload_pointer, size_t block_size);
+static size_t pack(size_t size, int alloc, int prev_alloc);
 static void *GHA(void *payload_pointer);
 static void *GFA(void *payload_pointer);
 static size_t get(void *addr);
 static size_t get_size(void *addr);
 static int get_alloc(void *addr);
+static int get_prev_alloc(void *addr);
+static void set_prev(void *payload_pointer, int prev_alloc, size_t prev_size);
+static size_t block_size_of(size_t size);
 static void put(void* adddr, size_t val);
 static char *prev_blk(void* payload_pointer);
 static char *next_blk(void* payload_pointer);
 static void* coalesce(void *payload_pointer);
 static size_t place(void* payload_pointer, size_t block_size);
+static size_t split_block(void* payload_pointer, size_t old_size, size_t block_size);
+static bool grow_in_place(void* payload_pointer, size_t block_size, size_t reserve_size, bool extend_heap);
+static void* grow_backward(void* payload_pointer, size_t block_size, size_t reserve_size);
+static void mark_grown(void* payload_pointer);
+static void purge_free_blocks(void);
 static void* find_fit(size_t block_size);
-static void put_pointer(void* addr, void* pointer);
+static void* tightest_fit(char* sentinel, size_t block_size, size_t max_scanned);
+static size_t size_class(size_t block_size);
+static void insert_free_block(void* payload_pointer);
+static void remove_free_block(void* payload_pointer);
+static bool class_nonempty(size_t class);
+#if TLSF
+static size_t tlsf_class(size_t fl, size_t sl);
+static uint8_t *sl_maps(void);
+#endif
+static char *list_sentinel(size_t class);
+static char *get_pred(void* payload_pointer);
+static char *get_succ(void* payload_pointer);
+static void set_pred(void* payload_pointer, char* pred);
+static void set_succ(void* payload_pointer, char* succ);
+static uint32_t block_link(char* payload_pointer);
+static char *link_block(uint32_t link);
+static void purge_block(char* block, size_t page);
+#if TREE_MIN_BLOCK
+static bool tree_before(size_t size, char* address, char* node);
+static char *tree_left(char* node);
+static char *tree_right(char* node);
+static void set_tree_left(char* node, char* left);
+static void set_tree_right(char* node, char* right);
+static char *tree_splay(char* root, size_t size, char* address);
+static char *tree_lower_bound(size_t size, char* address);
+static void tree_insert_block(char* payload_pointer);
+static void tree_remove_block(char* payload_pointer);
+#ifdef DEBUG
+static bool tree_check(char* node, size_t lo_size, char* lo_address, size_t hi_size, char* hi_address, int lineno);
+#endif
+#endif
 static size_t PtI(void* pointer);
 static void* ItP(size_t ptr_int);
+#if THREAD_SAFE
+static size_t tcache_bin(size_t block_size);
+static void tcache_push(size_t bin, void* payload_pointer);
+static void* tcache_pop(size_t bin);
+static void* cache_pop(size_t bin);
+static bool cache_push(size_t bin, void* payload_pointer);
+static void cache_flush(size_t bin, size_t count);
+static void tcache_register(void);
+static void tcache_make_key(void);
+static void tcache_release(void* cache);
+static struct arena *arena_of(void* payload_pointer);
+static struct arena *home_arena(void);
+static void remote_free(struct arena *owner, void* payload_pointer);
+static void drain_remote_frees(void);
+#endif
+#if RSEQ_CACHE
+static void* cpu_cache_pop(size_t bin);
+static bool cpu_cache_push(size_t bin, void* payload_pointer);
+#endif
 
 /* Global Variables: Only allowed 128 bytes*/
-char *free_root = NULL; // The root of the the free list (points to payload pointer; INVARIANT: pred is always NULL)
-static char *TOH = NULL; // Next free payload pointer of the never allocated heap area
+#if THREAD_SAFE
+static __thread struct arena *arena = NULL; // Arena the calling thread is working on (thread local, holds its lock)
+static __thread struct arena *home = NULL; // Arena the calling thread allocates from
+static size_t next_arena = 0; // Round robin counter handing out home arenas to new threads
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key; // Its destructor flushes the cache of an exiting thread
+static __thread struct tcache tcache; // One per thread (thread local storage, not a shared global)
+#if RSEQ_CACHE
+static struct cpu_bin *cpu_caches = NULL; // TCACHE_BINS bins per CPU in a memlib region, NULL without rseq
+static uint32_t num_cpus = 0; // CPUs with a cache in cpu_caches
+#endif
+#else
+static struct arena *arena = NULL; // Arena being worked on: the heap's, or the slab arena while it hands out a run
+#endif
+#if SLAB
+static char *slab_base = NULL; // Payload of the first run of the slab arena, runs follow every RUN_SIZE bytes
+static struct run *slab_runs[SLAB_CLASSES]; // Runs with a free slot, one list per slot size
+#endif
 
 /* 
 * rounds up to the nearest multiple of ALIGNMENT 
@@ -110,34 +567,123 @@ static size_t align(size_t x){
  */
 bool mm_init(void){
 
-    // Reset free_root to null because traces are ran twicee
-    free_root = NULL;
-    TOH = NULL;
+#if THREAD_SAFE
+    // Blocks cached by this thread belonged to the old heaps (other threads must not use the allocator yet)
+    for(size_t bin = 0; bin < TCACHE_BINS; bin++){
+        tcache.bins[bin] = NULL;
+        tcache.counts[bin] = 0;
+    }
+#endif
+
+    // Every arena starts over because traces are ran twicee (arena 0 last, so it is the current one)
+    for(size_t id = NUM_ARENAS; id-- > 0;){
+        if(!arena_init(id)){
+            return false;
+        }
+    }
+
+    // The slab arena follows the arenas, its runs start right after its prologue
+#if SLAB
+    struct arena *heap_arena = arena;
+    if(!arena_init(SLAB_HEAP)){
+        return false;
+    }
+    slab_base = arena->TOH;
+    arena = heap_arena;
+    for(size_t class = 0; class < SLAB_CLASSES; class++){
+        slab_runs[class] = NULL;
+    }
+#endif
+
+    // The initializing thread allocates from arena 0, later threads get the next ones
+#if THREAD_SAFE
+    home = arena;
+    next_arena = 1;
+#endif
+
+    // With rseq registered, small blocks are cached per CPU (a fresh mapping is zero: every bin empty)
+#if RSEQ_CACHE
+    cpu_caches = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if(__rseq_size != 0 && cpus > 0){
+        size_t page = mem_pagesize();
+        size_t caches_size = ((size_t)cpus * TCACHE_BINS * sizeof(struct cpu_bin) + page - 1) & ~(page - 1);
+        cpu_caches = mem_map(caches_size);
+        num_cpus = (uint32_t)cpus;
+    }
+#endif
+
+    return true;
+}
+
+/*
+* arena_init: sets up an empty arena in memlib heap id and makes it the current arena
+*/
+bool arena_init(size_t id){
 
-    // Initial allocate of 8 words
-    char *mem_brk = mem_sbrk(32);
+    // Initial allocate of the arena, the size class sentinels + 4 words (padding, prologue and epilogue)
+    size_t init_size = ARENA_SIZE + ROOTS_SIZE + 32;
+    char *mem_brk = mem_sbrk_at(id, init_size);
 
     // Initial allocation failed
-    if(mem_brk == NULL || *(int*)mem_brk == -1){
-        printf("Initial 16 byte allocation failed\n");
+    if(mem_brk == (void*)-1){
+        printf("Arena allocation failed: %zu bytes for the arena, size class sentinels, prologue and epilogue of heap %zu\n",
+               init_size, id);
         return false;
     }
 
+    // The arena lives at the start of its heap
+    arena = (struct arena*)mem_brk;
+    mem_brk += ARENA_SIZE;
+#if THREAD_SAFE
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->remote_frees = NULL;
+#endif
+    arena->op_clock = 0;
+    arena->class_map = 0;
+#if TREE_MIN_BLOCK
+    arena->tree_root = NULL;
+#endif
+    arena->id = id;
+#if QUICK_BINS
+    for(size_t bin = 0; bin < QUICK_BINS; bin++){
+        arena->quick_lists[bin] = NULL;
+    }
+    arena->quick_map = 0;
+#endif
+#if DEFERRED_COALESCING
+    arena->pending_count = 0;
+#endif
+#if PURGE
+    arena->zero_lo = NULL;
+    arena->zero_hi = NULL;
+#endif
+
+    // Size class sentinels sit below the prologue, all lists start empty
+    arena->sentinels = mem_brk;
+    for(size_t class = 0; class < NUM_CLASSES; class++){
+        set_pred(list_sentinel(class), list_sentinel(class));
+        set_succ(list_sentinel(class), list_sentinel(class));
+    }
+#if TLSF
+    for(size_t fl = 0; fl < FL_COUNT; fl++){
+        sl_maps()[fl] = 0;
+    }
+#endif
+    mem_brk += ROOTS_SIZE;
+
     // Set unused blocks
     put(mem_brk, 0);
 
     // Set prologue block 
-    put(mem_brk + 8, pack(16, 1));
-    put(mem_brk + 16, pack(16, 1));
+    put(mem_brk + 8, pack(16, 1, 1));
+    put(mem_brk + 16, pack(16, 1, 1));
 
     // Set initial epilogue block 
-    put(mem_brk + 24 , pack(0, 1));
+    put(mem_brk + 24 , pack(0, 1, 1));
 
-    // Allocate the first free block
-    if(!allocate_page(2048)){
-        printf("Initial page allocation failed\n");
-        return false;
-    }
+    // The heap starts empty, the first malloc extends it by what it needs
+    arena->TOH = mem_brk + 32;
 
     return true;
 }
@@ -146,6 +692,52 @@ bool mm_init(void){
  * malloc
  */
 void* malloc(size_t size){
+#if THREAD_SAFE
+    size_t block_size = block_size_of(size);
+    bool cached = size != 0 && size <= TCACHE_MAX_BLOCK - 8;
+    size_t bin = tcache_bin(block_size);
+
+    // Small requests are served from the cache without taking the lock
+    if(cached){
+        void* payload_pointer = cache_pop(bin);
+        if(payload_pointer != NULL){
+            return payload_pointer;
+        }
+    }
+
+    arena = home_arena();
+    pthread_mutex_lock(&arena->lock);
+    drain_remote_frees();
+    void* payload_pointer = heap_malloc(size);
+
+    // Refill the empty bin with blocks of the same size while the lock is held
+    for(size_t i = 1; cached && payload_pointer != NULL && i < TCACHE_FILL; i++){
+        void* block = heap_malloc(size);
+        if(block == NULL){
+            break;
+        }
+        if(!cache_push(bin, block)){
+            heap_free(block);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    return payload_pointer;
+#else
+#if SLAB
+    if(size != 0 && size <= SLAB_MAX_SIZE){
+        return slab_malloc(size);
+    }
+#endif
+    return heap_malloc(size);
+#endif
+}
+
+/*
+* heap_malloc: malloc from the current arena (a THREAD_SAFE build holds its lock)
+*/
+void* heap_malloc(size_t size){
 
     dbg_printf("\nStepping into malloc:\n");
     dbg_printf("----- Before mallocing: ");
@@ -153,10 +745,9 @@ void* malloc(size_t size){
 
     // Local payload_pointer
     char* payload_pointer;
-    size_t allocated_size;
 
-    // size + header + footer: alligned (in bytes)
-    size_t block_size = align(size+16);
+    // size + header: alligned (in bytes)
+    size_t block_size = block_size_of(size);
 
     // size = 0 error
     if(size == 0){ 
@@ -164,12 +755,71 @@ void* malloc(size_t size){
         return NULL;
     }
 
-    // Search free list for a block that will fit size
-    if((payload_pointer = find_fit(block_size)) != NULL){
+    // Huge requests never touch the heap
+    if(size >= MMAP_THRESHOLD){
+        return map_block(size);
+    }
+
+    // Large free blocks that stayed cold long enough give their pages back
+#if PURGE
+    if(++arena->op_clock % PURGE_INTERVAL == 0){
+        purge_free_blocks();
+    }
+#endif
+
+#if QUICK_BINS
+    // A block of exactly this size on its quick list is already allocated
+    if(block_size <= QUICK_MAX_BLOCK && arena->quick_lists[quick_bin(block_size)] != NULL){
+        size_t bin = quick_bin(block_size);
+        payload_pointer = arena->quick_lists[bin];
+        arena->quick_lists[bin] = *(char**)payload_pointer;
+        if(arena->quick_lists[bin] == NULL){
+            arena->quick_map &= ~((uint64_t)1 << bin);
+        }
+        return payload_pointer;
+    }
+#endif
+
+    payload_pointer = allocate_block(block_size);
+
+    // debug
+    dbg_printf("----- Aafter mallocing: ");
+    mm_checkheap(__LINE__);
+    dbg_printf("----- Payload pointer : %p\n", payload_pointer);
+
+    // return payload location 
+    return payload_pointer;
+}
+
+/*
+* allocate_block: allocates a block of block_size bytes from a free block that fits, or else from the top of
+*                 the heap. Returns its payload pointer, or NULL when the heap cannot grow
+*/
+void* allocate_block(size_t block_size){
+
+    char* payload_pointer;
+    size_t allocated_size;
+
+    // Search free list for a block that will fit size, the pending blocks and then the quick lists are
+    // consolidated before giving up
+    payload_pointer = find_fit(block_size);
+#if DEFERRED_COALESCING
+    if(payload_pointer == NULL && arena->pending_count != 0){
+        flush_pending();
+        payload_pointer = find_fit(block_size);
+    }
+#endif
+#if QUICK_BINS
+    if(payload_pointer == NULL && arena->quick_map != 0){
+        consolidate_quick_lists();
+        payload_pointer = find_fit(block_size);
+    }
+#endif
+    if(payload_pointer != NULL){
         allocated_size = place(payload_pointer, block_size);
-        if(payload_pointer == TOH){
+        if(payload_pointer == arena->TOH){
             // update 
-            TOH = (allocated_size == block_size) ? TOH + block_size : TOH + allocated_size;
+            arena->TOH += allocated_size;
         }
 
         return payload_pointer;
@@ -180,123 +830,338 @@ void* malloc(size_t size){
     * to fit the block size, add it to the top of heap
     ****************************************************/
 
-    // tmp_pos = how far the block will extend; also next PP
-    void *tmp_pos = TOH + block_size; 
-    
-    // if(tmp_pos > (void*)((char*)mem_heap_hi() - 8)){
-    //     // Pre processing
-    //     size_t page_size = (size_t)(PtI(tmp_pos) - PtI(mem_heap_hi()));
-    //     page_size = align(page_size);
-    //     page_size = (page_size % 32 != 0) ? page_size + 16 : page_size;
-
-    //     // Allocatee the page
-    //     allocate_page(page_size);
-    // }
-
-    // allocate page if tmp_pos exceeds the current heap size (Minus the epilogue header) 
-    while(tmp_pos > (void*)((char*)mem_heap_hi() - 8)){
-        if(!allocate_page(32768)){
-            printf("Page allocation failed during malloc");
-            return NULL;
-        }
+    // allocate page unless the free block at the top of the heap already holds the block
+    size_t top_free = get_alloc(GHA(arena->TOH)) ? 0 : get_size(GHA(arena->TOH));
+    if(top_free < block_size && !grow_heap(block_size)){
+        printf("Page allocation failed during malloc");
+        return NULL;
     }
 
     // place the block at the top of the heap
-    allocated_size = place((void*)TOH, block_size);
+    payload_pointer = arena->TOH;
+    allocated_size = place((void*)payload_pointer, block_size);
 
     // update 
-    TOH = (allocated_size == block_size) ? (char*)tmp_pos : (char*)tmp_pos - block_size + allocated_size;
-
-    // debug
-    dbg_printf("----- Aafter mallocing: ");
-    mm_checkheap(__LINE__);
-    dbg_printf("----- Payload pointer : %p\n", payload_pointer);
+    arena->TOH = payload_pointer + allocated_size;
 
-    // return payload location 
-    return (TOH - allocated_size);
+    return payload_pointer;
 }
 
 /*
  * free
  */
 void free(void* payload_pointer)
+{
+#if THREAD_SAFE
+    if(payload_pointer == NULL){
+        return;
+    }
+
+    // Small blocks go to the thread's cache (get_size drops the MAPPED bit, but mapped blocks are never small).
+    // The header is read without the lock: other threads only rewrite its prev bits, never its size or alloc bit,
+    // and get and put access header words atomically so the read does not race with them
+    size_t size = get_size(GHA(payload_pointer));
+    if(size <= TCACHE_MAX_BLOCK && get_alloc(GHA(payload_pointer))){
+        size_t bin = tcache_bin(size);
+
+        // A full bin hands a batch back to the heap under one lock
+        while(!cache_push(bin, payload_pointer)){
+            cache_flush(bin, TCACHE_FLUSH);
+        }
+        return;
+    }
+
+    // A block of another arena is queued for its owner without taking the owner's lock
+    arena = arena_of(payload_pointer);
+    if(arena != home_arena()){
+        remote_free(arena, payload_pointer);
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    heap_free(payload_pointer);
+    pthread_mutex_unlock(&arena->lock);
+#else
+#if SLAB
+    if(is_slab(payload_pointer)){
+        slab_free(payload_pointer);
+        return;
+    }
+#endif
+    heap_free(payload_pointer);
+#endif
+}
+
+/*
+* heap_free: free to the current arena (a THREAD_SAFE build holds its lock)
+*/
+void heap_free(void* payload_pointer)
 {    
     dbg_printf("\nStepping into free:\n");
     dbg_printf("----- Freeing: %p\n", payload_pointer);
     mm_checkheap(__LINE__);
 
+    // Large free blocks that stayed cold long enough give their pages back
+#if PURGE
+    if(++arena->op_clock % PURGE_INTERVAL == 0){
+        purge_free_blocks();
+    }
+#endif
+
     // If PP != NULL && PP was allocated, free
     if(!(payload_pointer == NULL) && get_alloc(GHA(payload_pointer))){
         size_t size = get_size(GHA(payload_pointer));
 
-        // Update block allocation status
-        put(GHA(payload_pointer), pack(size, 0));
-        put(GFA(payload_pointer), pack(size, 0));
+        // A mapped block goes straight back to memlib
+        if(get(GHA(payload_pointer)) & MAPPED){
+            mem_unmap((char*)payload_pointer - 16, size);
+            return;
+        }
 
-        // Edge case: the block you are trying to free is right before the TOH
-        if((char*)payload_pointer + size == TOH && !get_alloc(GHA(TOH))){
-            TOH = coalesce(payload_pointer);
-        }else{
-            coalesce(payload_pointer); 
+        // The block is done growing (quick lists and the pending buffer keep the header as it is)
+        put(GHA(payload_pointer), get(GHA(payload_pointer)) & ~(size_t)GROWN);
+
+#if QUICK_BINS
+        // A small block goes on its quick list as it is
+        if(size <= QUICK_MAX_BLOCK){
+            size_t bin = quick_bin(size);
+            *(char**)payload_pointer = arena->quick_lists[bin];
+            arena->quick_lists[bin] = payload_pointer;
+            arena->quick_map |= (uint64_t)1 << bin;
+            return;
+        }
+#endif
+
+#if DEFERRED_COALESCING
+        // The block waits in the pending buffer, a full buffer is coalesced in one pass
+        arena->pending[arena->pending_count++] = payload_pointer;
+        if(arena->pending_count == PENDING_COUNT){
+            flush_pending();
         }
+#else
+        free_block(payload_pointer, size);
+#endif
     } 
 }
 
+/*
+* free_block: frees the allocated size byte block at payload_pointer into the free lists, coalescing it
+*/
+void free_block(void* payload_pointer, size_t size){
+
+    // Update block allocation status (coalesce writes the footer and the next block's prev bits)
+    put(GHA(payload_pointer), get(GHA(payload_pointer)) & ~(size_t)0x1);
+
+    // Edge case: the block you are trying to free is right before the TOH (or is the top block)
+    if((char*)payload_pointer + size == arena->TOH){
+        arena->TOH = coalesce(payload_pointer);
+
+        // Give a large free top of the heap back to memlib
+        if(get_size(GHA(arena->TOH)) > TRIM_THRESHOLD){
+            trim_heap(TRIM_PAD);
+        }
+    }else{
+        coalesce(payload_pointer); 
+    }
+}
+
+#if DEFERRED_COALESCING
+/*
+* flush_pending: frees the pending blocks in address order, each run of adjacent ones as a single block
+*/
+void flush_pending(void){
+    size_t count = arena->pending_count;
+    arena->pending_count = 0;
+    // Insertion sort, the buffer is small enough that qsort's calls cost more
+    for(size_t i = 1; i < count; i++){
+        char* block = arena->pending[i];
+        size_t j = i;
+        for(; j > 0 && arena->pending[j - 1] > block; j--){
+            arena->pending[j] = arena->pending[j - 1];
+        }
+        arena->pending[j] = block;
+    }
+
+    for(size_t i = 0; i < count;){
+        char* first = arena->pending[i++];
+        size_t size = get_size(GHA(first));
+        while(i < count && arena->pending[i] == first + size){
+            size += get_size(GHA(arena->pending[i++]));
+        }
+        put(GHA(first), pack(size, 1, get_prev_alloc(GHA(first))) | (get(GHA(first)) & PREV_MINI));
+        free_block(first, size);
+    }
+}
+#endif
+
+#if QUICK_BINS
+/*
+* quick_bin: index of the quick list for blocks of block_size bytes
+*/
+size_t quick_bin(size_t block_size){
+    return block_size / ALIGNMENT - 1;
+}
+
+/*
+* consolidate_quick_lists: frees every block on the quick lists into the free lists, coalescing them
+*/
+void consolidate_quick_lists(void){
+    while(arena->quick_map != 0){
+        size_t bin = (size_t)__builtin_ctzll(arena->quick_map);
+        char* payload_pointer = arena->quick_lists[bin];
+        arena->quick_lists[bin] = NULL;
+        arena->quick_map &= arena->quick_map - 1;
+
+        while(payload_pointer != NULL){
+            char* next = *(char**)payload_pointer;
+            free_block(payload_pointer, (bin + 1) * ALIGNMENT);
+            payload_pointer = next;
+        }
+    }
+}
+#endif
+
 /*
  * realloc
  */
 void* realloc(void* oldptr, size_t size)
+{
+#if THREAD_SAFE
+    // The plain malloc and free cases go through the thread's cache
+    if(oldptr == NULL){
+        return malloc(size);
+    }
+    if(size == 0){
+        free(oldptr);
+        return NULL;
+    }
+
+    // The block grows (or moves) within its own arena
+    arena = arena_of(oldptr);
+    pthread_mutex_lock(&arena->lock);
+    void* newptr = heap_realloc(oldptr, size);
+    pthread_mutex_unlock(&arena->lock);
+
+    return newptr;
+#else
+    // A new block comes from malloc, so small requests get a slot
+    if(oldptr == NULL){
+        return malloc(size);
+    }
+#if SLAB
+    if(is_slab(oldptr)){
+        return slab_realloc(oldptr, size);
+    }
+#endif
+    return heap_realloc(oldptr, size);
+#endif
+}
+
+/*
+* heap_realloc: realloc on the current arena (a THREAD_SAFE build holds its lock)
+*/
+void* heap_realloc(void* oldptr, size_t size)
 {    
     // Pointer to new location
     void* newptr = NULL;
-    size_t block_size = align(size+16);
+    size_t block_size = block_size_of(size);
 
     // "malloc"
     if(oldptr == NULL){
-        newptr = malloc(size);
+        newptr = heap_malloc(size);
         return newptr;
     }
 
     // "free"
     if(size == 0){
-        free(oldptr);
+        heap_free(oldptr);
         return NULL;
     }
 
+    // Mapped blocks stay mapped while they are huge (moving pages, not bytes), and move into the heap otherwise
+    if(get_alloc(GHA(oldptr)) && (get(GHA(oldptr)) & MAPPED)){
+        if(size >= MMAP_THRESHOLD){
+            return remap_block(oldptr, size);
+        }
+        newptr = heap_malloc(size);
+        if(newptr != NULL){
+            memcpy(newptr, oldptr, size);
+            heap_free(oldptr);
+        }
+        return newptr;
+    }
+
+    // A heap block that becomes huge moves to its own mapping
+    if(get_alloc(GHA(oldptr)) && size >= MMAP_THRESHOLD){
+        newptr = map_block(size);
+        if(newptr != NULL){
+            memcpy(newptr, oldptr, get_size(GHA(oldptr)) - 8);
+            heap_free(oldptr);
+        }
+        return newptr;
+    }
+
     // Realloc and free
     if(get_alloc(GHA(oldptr))){
         size_t old_size = get_size(GHA(oldptr));
         int64_t remainder = (int64_t)old_size - (int64_t)block_size;
 
-        // Realloc will take up the whole block again, no extra bytes
-        if(remainder >= 0 && remainder <= 32){    
-            put(GHA(oldptr), pack(old_size, 1));
-            put(GFA(oldptr), pack(old_size, 1)); 
+        // A block that grows again gets 1.5 times what it needs, like a vector, so later grows are free (the block
+        // is allocated, so bit 3 is GROWN: PURGED only lives in free headers)
+        bool grown = (get(GHA(oldptr)) & GROWN) != 0;
+        size_t reserve_size = grown ? align(block_size + block_size / 2) : block_size;
 
+        // Realloc will take up the whole block again, no extra bytes (or the bytes are a reserved tail)
+        if(remainder >= 0 && (remainder < MINI_BLOCK_SIZE || (grown && old_size <= reserve_size))){
             return oldptr; 
         }
 
         // Realloc is shrunk, and the remaining bytes > minimum block size
-        else if(remainder > 32){
-            // Set the header and footer of the newly the allocated block
-            put(GHA(oldptr), pack(block_size, 1));
-            put(GFA(oldptr), pack(block_size, 1)); 
+        else if(remainder >= MINI_BLOCK_SIZE){
+            // Set the header of the newly the allocated block
+            put(GHA(oldptr), pack(block_size, 1, get_prev_alloc(GHA(oldptr))) | (get(GHA(oldptr)) & PREV_MINI));
+
+            // Set header for un-used bytes, then free them (coalesced right away, a tail never goes on a quick list)
+            put(GHA(next_blk(oldptr)), pack((size_t)remainder, 1, 1)); 
+            set_prev(next_blk(oldptr), 1, block_size);
+
+            free_block(next_blk(oldptr), (size_t)remainder);
+
+            return oldptr;
+        }
 
-            // Set header and footer for un-used bytes 
-            put(GHA(next_blk(oldptr)), pack((size_t)remainder, 1)); 
-            put(GFA(next_blk(oldptr)), pack((size_t)remainder, 1)); 
+        // Realloc grew, absorb a free next block if it is enough (the heap does not grow)
+        else if(grow_in_place(oldptr, block_size, reserve_size, false)){
+            return oldptr;
+        }
 
-            free(next_blk(oldptr));
+        // Realloc grew, slide into a free previous block (and a free next block) if they are enough
+        else if((newptr = grow_backward(oldptr, block_size, reserve_size)) != NULL){
+            return newptr;
+        }
 
+        // Realloc grew, a block at the top of the heap extends the heap
+        else if(grow_in_place(oldptr, block_size, reserve_size, true)){
             return oldptr;
         }
 
+        // Realloc grew, a large block that would end up at the top of the heap anyway moves its pages there
+        else if(old_size >= REMAP_THRESHOLD && find_fit(reserve_size) == NULL &&
+                (newptr = move_to_top(oldptr, reserve_size)) != NULL){
+            mark_grown(newptr);
+            return newptr;
+        }
+
         // Realloc grew, new block is needed
         else{
             // Malloc and free
-            newptr = malloc(size);
-            memcpy(newptr, oldptr, old_size);
-            free(oldptr);
+            newptr = heap_malloc(reserve_size - 8);
+            if(newptr == NULL){
+                return NULL;
+            }
+            memcpy(newptr, oldptr, old_size - 8);
+            heap_free(oldptr);
+            mark_grown(newptr);
 
             return newptr;
         }
@@ -306,139 +1171,1109 @@ void* realloc(void* oldptr, size_t size)
 }
 
 /*
- * calloc
- * This function is not tested by mdriver, and has been implemented for you.
- */
-void* calloc(size_t nmemb, size_t size)
-{
-    void* ptr;
-    size *= nmemb;
-    ptr = malloc(size);
-    if (ptr) {
-        memset(ptr, 0, size);
-    }
-    return ptr;
-}
-
-/*
- * Returns whether the pointer is in the heap.
- * May be useful for debugging.
- */
-static bool in_heap(const void* p)
-{
-    return p <= mem_heap_hi() && p >= mem_heap_lo();
-}
-
-/*
- * Returns whether the pointer is aligned.
- * May be useful for debugging.
- */
-static bool aligned(const void* p)
-{
-    size_t ip = (size_t) p;
-    return align(ip) == ip;
-}
-
-/*
- * mm_checkheap
- */
-bool mm_checkheap(int lineno)
-{
-#ifdef DEBUG
-    dbg_printf("\nChecking Heap...\n");
-
-    // Vars for checking free list 
-    char* next_free = free_root;
-    char* pred = NULL;
-
-    // Vars for checking allocated blocks (first block)
-    // char* next_allocated = (char*)0x7efff72e7020; 
+* grow_in_place: grows the allocated block at payload_pointer to at least block_size bytes by absorbing the
+*                next block when it is free, keeping up to reserve_size bytes. With extend_heap, a block at the top
+*                of the heap first extends the heap until the top free block makes up reserve_size. Returns
+*                false when that is not enough
+*/
+bool grow_in_place(void* payload_pointer, size_t block_size, size_t reserve_size, bool extend_heap){
 
-    // Checks the free list
-    while(next_free != NULL){
+    char* next = next_blk(payload_pointer);
+    size_t old_size = get_size(GHA(payload_pointer));
 
-        // Check each free block is actualy freed
-        if(get_alloc(GHA(next_free)) != 0){
-            dbg_printf("Check heap: address %p is currently allocated and pointed to by %p\n", next_free, pred);
+    // Block borders the top of the heap: the new page coalesces into next (or becomes next at the epilogue)
+    if(extend_heap && next == arena->TOH && old_size + (get_alloc(GHA(next)) ? 0 : get_size(GHA(next))) < reserve_size){
+        if(!grow_heap(reserve_size - old_size)){
             return false;
         }
+    }
 
-        // Check free list
-        if(!in_heap(next_free)){
-            dbg_printf("free root (%p) is not in heap at line %d\n", next_free, lineno);
-        }else if(!in_heap(ItP(get(next_free + 8))) && ItP(get(next_free + 8)) != NULL ){
-            dbg_printf("succ(free root) (OFR = %p, FR = %p) is not in heap at line %d\n", ItP(get(next_free + 8)), next_free, lineno);
-        }
+    // The next block must be free and big enough
+    if(get_alloc(GHA(next)) || old_size + get_size(GHA(next)) < block_size){
+        return false;
+    }
 
-        // // Headers and footers match 
-        // if(get(GHA(next_blk)) != get(GFA(next_blk))){
-        //     dbg_printf("Header and footer of payload pointer %p do not match", next_blk);
-        // }
-        // // Contiguious memory escaped coalescing
-        // if(!get_alloc(GHA(prev_blk(next_free)))){
-        //     dbg_printf("Previous block at %p is free: Contigious memory", prev_blk(next_free));
-        // }else if(!get_alloc(GHA(next_blk(next_free)))){
-        //     dbg_printf("Next block at %p is free: Contigious memory", next_blk(next_free));
-        // }
+    // Merge with the next block and give back what is not needed
+    size_t size = old_size + get_size(GHA(next));
+    remove_free_block(next);
+    size_t allocated_size = split_block(payload_pointer, size, (size < reserve_size) ? size : reserve_size);
+    mark_grown(payload_pointer);
 
-        // go to next free block
-        pred = next_free;
-        next_free = ItP(get(next_free + 8));   
+    // The top free block was absorbed, TOH is whatever follows now
+    if(next == arena->TOH){
+        arena->TOH = (char*)payload_pointer + allocated_size;
     }
 
-    // // Check allocated blocks (not needed right now)
-    // while(next_allocated != mem_heap_hi() + 1){
-    //     // Get the next block
-    //     void* next_block = next_blk(next_allocated);
-    //     if(get_alloc(GHA(next_block))){
-    //         if((char*)next_block - 8 < (next_allocated + get_size(GHA(next_allocated)))){
-    //             dbg_printf("Overlapping allocated bytes");
-    //         }
-    //     }
-    //     next_allocated = next_block;
-    // }
-
-    dbg_printf("Heap is consistent at line %d\n", lineno);
-#endif /* DEBUG */
     return true;
 }
 
 /*
-* allocate_page: Allocates a page and coalesces 
+* grow_backward: grows the allocated block at payload_pointer to at least block_size bytes by merging it with
+*                the free block before it (and the next block when that one is free too), then sliding the
+*                payload down, keeping up to reserve_size bytes. Returns the new payload pointer, or NULL when
+*                the neighbours are not enough
 */
-bool allocate_page(size_t page_size){
+void* grow_backward(void* payload_pointer, size_t block_size, size_t reserve_size){
 
-    // 1/32 MiB
-    // size_t page_size = 32768;
+    if(get_prev_alloc(GHA(payload_pointer))){
+        return NULL;
+    }
 
-    // Allocate a page (page_size bytes);
-    void *payload_pointer = mem_sbrk(page_size); // mem-brk returns a PP in this implimentation
+    char* prev = prev_blk(payload_pointer);
+    char* next = next_blk(payload_pointer);
+    size_t old_size = get_size(GHA(payload_pointer));
+    bool next_free = !get_alloc(GHA(next));
+    size_t size = get_size(GHA(prev)) + old_size + (next_free ? get_size(GHA(next)) : 0);
 
-    // Initial allocation failed
-    if(payload_pointer == NULL || *(int*)payload_pointer == -1){
-        printf("Page allocation failed: heap size %zu/%llu bytes\n", mem_heapsize() + page_size, MAX_HEAP_SIZE);
-        return false;
+    if(size < block_size){
+        return NULL;
     }
 
-    // Set footer and header blocks for allocated block
-    put(GHA(payload_pointer), pack(page_size,0)); // Overwrites old epilogue header
-    put(GFA(payload_pointer), pack(page_size,0));
+    // Unlink the neighbours before the payload overwrites prev's links
+    remove_free_block(prev);
+    if(next_free){
+        remove_free_block(next);
+    }
+    memmove(prev, payload_pointer, old_size - 8);
 
-    // Set new epilogue header
-    put(GHA(next_blk(payload_pointer)), pack(0,1));
-    
-    // Update TOH 
-    TOH = coalesce(payload_pointer);
+    // One allocated block and at most one free hole after it
+    size_t allocated_size = split_block(prev, size, (size < reserve_size) ? size : reserve_size);
+    mark_grown(prev);
 
-    return true;
+    // The block bordered the top (the top free block or the epilogue), TOH is whatever follows it now
+    if(next == arena->TOH){
+        arena->TOH = prev + allocated_size;
+    }
+
+    return prev;
+}
+
+/*
+* mark_grown: marks a block realloc has grown, so its next growth reserves a tail. Mapped blocks are resized
+*             by mem_remap and keep no tail. A THREAD_SAFE build leaves the blocks its thread caches recycle
+*             unmarked, the caches cannot clear the bit without the arena's lock
+*/
+void mark_grown(void* payload_pointer){
+    size_t header = get(GHA(payload_pointer));
+    if(header & MAPPED){
+        return;
+    }
+#if THREAD_SAFE
+    if(get_size(GHA(payload_pointer)) <= TCACHE_MAX_BLOCK){
+        return;
+    }
+#endif
+    put(GHA(payload_pointer), header | GROWN);
+}
+
+/*
+ * mm_trim: shrinks the free block at the top of the heap to pad bytes (rounded up to the alignment) and
+ *          returns the rest to memlib. Returns true if memory was released
+ */
+bool mm_trim(size_t pad){
+#if THREAD_SAFE
+    arena = home_arena();
+    pthread_mutex_lock(&arena->lock);
+    drain_remote_frees();
+#if DEFERRED_COALESCING
+    flush_pending();
+#endif
+#if QUICK_BINS
+    consolidate_quick_lists();
+#endif
+    bool trimmed = trim_heap(pad);
+    pthread_mutex_unlock(&arena->lock);
+
+    return trimmed;
+#else
+#if DEFERRED_COALESCING
+    flush_pending();
+#endif
+#if QUICK_BINS
+    consolidate_quick_lists();
+#endif
+    return trim_heap(pad);
+#endif
+}
+
+/*
+* trim_heap: mm_trim on the current arena (a THREAD_SAFE build holds its lock)
+*/
+bool trim_heap(size_t pad){
+
+    // Nothing to trim when the top block is allocated or already small enough
+    size_t keep = align(pad);
+    if(get_alloc(GHA(arena->TOH)) || get_size(GHA(arena->TOH)) <= keep){
+        return false;
+    }
+    size_t size = get_size(GHA(arena->TOH));
+
+    remove_free_block(arena->TOH);
+    if(mem_sbrk_at(arena->id, -(intptr_t)(size - keep)) == (void*)-1){
+        insert_free_block(arena->TOH);
+        return false;
+    }
+
+    if(keep == 0){
+        // The whole top block is gone, TOH is the epilogue now
+        put(GHA(arena->TOH), pack(0, 1, 1) | (get(GHA(arena->TOH)) & PREV_MINI));
+    }else{
+        // Keep pad bytes as the (smaller) top free block
+        put(GHA(arena->TOH), pack(keep, 0, 1) | (get(GHA(arena->TOH)) & PREV_MINI));
+        if(keep != MINI_BLOCK_SIZE){
+            put(GFA(arena->TOH), pack(keep, 0, 1));
+        }
+        put(GHA(next_blk(arena->TOH)), pack(0, 1, 0));
+        set_prev(next_blk(arena->TOH), 0, keep);
+        insert_free_block(arena->TOH);
+    }
+
+    return true;
+}
+
+/*
+ * mm_malloc_batch: allocates n blocks of size bytes into out. They are carved from one free block or one heap
+ *                  extension, so a batch costs about one malloc. Returns the number of blocks allocated
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void** out){
+#if THREAD_SAFE
+    // The caches are skipped, the batch comes straight from the home arena
+    arena = home_arena();
+    pthread_mutex_lock(&arena->lock);
+    drain_remote_frees();
+    size_t count = heap_malloc_batch(size, n, out);
+    pthread_mutex_unlock(&arena->lock);
+
+    return count;
+#else
+    return heap_malloc_batch(size, n, out);
+#endif
+}
+
+/*
+* heap_malloc_batch: mm_malloc_batch on the current arena (a THREAD_SAFE build holds its lock)
+*/
+size_t heap_malloc_batch(size_t size, size_t n, void** out){
+
+    size_t count = 0;
+    if(size == 0 || n == 0){
+        return 0;
+    }
+
+    // Allocate one block for the whole run (huge requests are mapped one by one below)
+    size_t block_size = block_size_of(size);
+    char* run = NULL;
+    if(size < MMAP_THRESHOLD && n <= MAX_HEAP_SIZE / block_size){
+#if PURGE
+        if(++arena->op_clock % PURGE_INTERVAL == 0){
+            purge_free_blocks();
+        }
+#endif
+        run = allocate_block(n * block_size);
+    }
+
+    // Split the run into n allocated blocks, the last one keeps any slack place left in the run
+    if(run != NULL){
+        size_t run_size = get_size(GHA(run));
+        put(GHA(run), pack(block_size, 1, get_prev_alloc(GHA(run))) | (get(GHA(run)) & PREV_MINI));
+        for(count = 1; count < n; count++){
+            put(GHA(run + count * block_size), pack(block_size, 1, 1) | ((block_size == MINI_BLOCK_SIZE) ? PREV_MINI : 0));
+        }
+        char* last = run + (n - 1) * block_size;
+        put(GHA(last), pack(run_size - (n - 1) * block_size, 1, get_prev_alloc(GHA(last))) | (get(GHA(last)) & PREV_MINI));
+        set_prev(next_blk(last), 1, get_size(GHA(last)));
+
+        for(count = 0; count < n; count++){
+            out[count] = run + count * block_size;
+        }
+    }
+
+    // No room for the run (or huge blocks): one malloc per block
+    for(; count < n; count++){
+        if((out[count] = heap_malloc(size)) == NULL){
+            break;
+        }
+    }
+
+    dbg_printf("----- After batch malloc: ");
+    mm_checkheap(__LINE__);
+
+    return count;
+}
+
+/*
+ * mm_free_batch: frees the n blocks in ptrs (NULL entries are skipped). ptrs is sorted by address, so runs of
+ *                adjacent blocks are merged and freed (and coalesced) as one block
+ */
+void mm_free_batch(void** ptrs, size_t n){
+
+    // Drop the NULL entries (and free slab slots right away) and sort the rest
+    size_t count = 0;
+    for(size_t i = 0; i < n; i++){
+#if SLAB
+        if(ptrs[i] != NULL && is_slab(ptrs[i])){
+            slab_free(ptrs[i]);
+            continue;
+        }
+#endif
+        if(ptrs[i] != NULL){
+            ptrs[count++] = ptrs[i];
+        }
+    }
+
+#if THREAD_SAFE
+    // Blocks of other arenas go to their remote free queues, the rest is freed under one lock
+    arena = home_arena();
+    size_t local = 0;
+    for(size_t i = 0; i < count; i++){
+        struct arena *owner = arena_of(ptrs[i]);
+        if(owner != arena){
+            remote_free(owner, ptrs[i]);
+        }else{
+            ptrs[local++] = ptrs[i];
+        }
+    }
+    qsort(ptrs, local, sizeof(void*), compare_addresses);
+
+    pthread_mutex_lock(&arena->lock);
+    heap_free_batch(ptrs, local);
+    pthread_mutex_unlock(&arena->lock);
+#else
+    qsort(ptrs, count, sizeof(void*), compare_addresses);
+    heap_free_batch(ptrs, count);
+#endif
+}
+
+/*
+* heap_free_batch: mm_free_batch on the current arena for ptrs sorted by address (a THREAD_SAFE build holds its
+*                  lock). A run of adjacent allocated blocks becomes one block before it is freed
+*/
+void heap_free_batch(void** ptrs, size_t n){
+
+    for(size_t i = 0; i < n;){
+        char* first = ptrs[i++];
+
+        // Mapped and already free blocks are left to free
+        if(get_alloc(GHA(first)) && !(get(GHA(first)) & MAPPED)){
+            size_t size = get_size(GHA(first));
+            while(i < n && (char*)ptrs[i] == first + size && get_alloc(GHA(ptrs[i])) && !(get(GHA(ptrs[i])) & MAPPED)){
+                size += get_size(GHA(ptrs[i++]));
+            }
+            put(GHA(first), pack(size, 1, get_prev_alloc(GHA(first))) | (get(GHA(first)) & PREV_MINI));
+        }
+        heap_free(first);
+    }
+}
+
+/*
+* compare_addresses: qsort order of pointers by address
+*/
+int compare_addresses(const void* a, const void* b){
+    uintptr_t x = (uintptr_t)*(void* const*)a;
+    uintptr_t y = (uintptr_t)*(void* const*)b;
+    return (x > y) - (x < y);
+}
+
+#if THREAD_SAFE
+/*
+* tcache_bin: index of the thread cache bin for blocks of block_size bytes
+*/
+size_t tcache_bin(size_t block_size){
+    return block_size / ALIGNMENT - 1;
+}
+
+/*
+* tcache_push: puts the allocated block at payload_pointer on top of the thread's bin
+*/
+void tcache_push(size_t bin, void* payload_pointer){
+    *(char**)payload_pointer = tcache.bins[bin];
+    tcache.bins[bin] = payload_pointer;
+    tcache.counts[bin]++;
+}
+
+/*
+* tcache_pop: takes the block on top of the thread's (non-empty) bin
+*/
+void* tcache_pop(size_t bin){
+    char* payload_pointer = tcache.bins[bin];
+    tcache.bins[bin] = *(char**)payload_pointer;
+    tcache.counts[bin]--;
+    return payload_pointer;
+}
+
+/*
+* cache_pop: takes a block from the bin of the CPU's cache (or of the thread's cache without rseq), NULL when empty
+*/
+void* cache_pop(size_t bin){
+#if RSEQ_CACHE
+    if(cpu_caches != NULL){
+        return cpu_cache_pop(bin);
+    }
+#endif
+    return (tcache.counts[bin] != 0) ? tcache_pop(bin) : NULL;
+}
+
+/*
+* cache_push: puts a block in the bin of the CPU's cache (or of the thread's cache), false when the bin is full
+*/
+bool cache_push(size_t bin, void* payload_pointer){
+#if RSEQ_CACHE
+    if(cpu_caches != NULL){
+        return cpu_cache_push(bin, payload_pointer);
+    }
+#endif
+    if(tcache.counts[bin] >= TCACHE_COUNT){
+        return false;
+    }
+    tcache_register();
+    tcache_push(bin, payload_pointer);
+    return true;
+}
+
+/*
+* cache_flush: frees up to count blocks of a cache bin, to the home arena under one lock and to the remote free
+*              queues of the other arenas
+*/
+void cache_flush(size_t bin, size_t count){
+    char* payload_pointer;
+
+    arena = home_arena();
+    pthread_mutex_lock(&arena->lock);
+    for(size_t i = 0; i < count && (payload_pointer = cache_pop(bin)) != NULL; i++){
+        struct arena *owner = arena_of(payload_pointer);
+        if(owner == arena){
+            heap_free(payload_pointer);
+        }else{
+            remote_free(owner, payload_pointer);
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+* remote_free: pushes a block onto the remote free queue of the arena owning it, lock free (any thread may push,
+*              only the holder of owner's lock takes blocks off)
+*/
+void remote_free(struct arena *owner, void* payload_pointer){
+    char* head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+    do{
+        *(char**)payload_pointer = head;
+    }while(!__atomic_compare_exchange_n(&owner->remote_frees, &head, (char*)payload_pointer, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+* drain_remote_frees: frees every block queued for the current arena by other threads (its lock is held). The
+*                     whole queue is taken with one exchange, so the pushes never see an ABA problem
+*/
+void drain_remote_frees(void){
+    if(__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL){
+        return;
+    }
+    char* payload_pointer = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while(payload_pointer != NULL){
+        char* next = *(char**)payload_pointer;
+        heap_free(payload_pointer);
+        payload_pointer = next;
+    }
+}
+
+/*
+* tcache_register: makes sure the thread's cache is flushed when the thread exits
+*/
+void tcache_register(void){
+    if(!tcache.registered){
+        pthread_once(&tcache_once, tcache_make_key);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = true;
+    }
+}
+
+/*
+* tcache_make_key: creates the key whose destructor runs tcache_release on thread exit
+*/
+void tcache_make_key(void){
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/*
+* arena_of: arena owning the block at payload_pointer, found from the memlib heap that holds it (a mapped
+*           block has none and is freed through the thread's home arena)
+*/
+struct arena *arena_of(void* payload_pointer){
+    size_t id = mem_heap_of(payload_pointer);
+    return (id < NUM_ARENAS) ? (struct arena*)mem_heap_lo_at(id) : home_arena();
+}
+
+/*
+* home_arena: arena the calling thread allocates from, handed out round robin on its first call
+*/
+struct arena *home_arena(void){
+    if(home == NULL){
+        size_t id = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % NUM_ARENAS;
+        home = (struct arena*)mem_heap_lo_at(id);
+    }
+    return home;
+}
+
+/*
+* tcache_release: thread exit destructor, gives every cached block back to its arena
+*/
+void tcache_release(void* cache){
+    for(size_t bin = 0; bin < TCACHE_BINS; bin++){
+        cache_flush(bin, tcache.counts[bin]);
+    }
+}
+#endif
+
+#if RSEQ_CACHE
+/*
+* cpu_cache_pop: takes a block from the bin of the CPU the thread runs on, NULL when the bin is empty. The pop is
+*                a restartable sequence: the kernel restarts it from the top if the thread is preempted or
+*                migrated before the count store that commits it, so it needs no lock and no atomics
+*/
+void* cpu_cache_pop(size_t bin){
+    struct rseq *rs = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+    char* payload_pointer = NULL;
+
+restart:
+    __asm__ goto(
+        // The critical section descriptor: start, length up to the commit, abort handler
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        // rax = this CPU's bin
+        "movl %[cpu_id], %%eax\n\t"
+        "cmpl %[num_cpus], %%eax\n\t"
+        "jae %l[empty]\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[bin], %%rax\n\t"
+        // Pop slots[count - 1], the count store commits
+        "movq (%%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[empty]\n\t"
+        "movq (%%rax, %%rcx, 8), %%rdx\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"
+        "2:\n\t"
+        "movq %%rdx, (%[out])\n\t"
+        // Abort handler, behind the signature the kernel checks
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "jmp %l[restart]\n\t"
+        ".popsection\n\t"
+        :
+        : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id), [num_cpus] "r"(num_cpus),
+          [stride] "r"(TCACHE_BINS * sizeof(struct cpu_bin)), [bin] "r"(cpu_caches + bin),
+          [out] "r"(&payload_pointer), [sig] "i"(RSEQ_SIG)
+        : "rax", "rcx", "rdx", "memory", "cc"
+        : restart, empty);
+
+    return payload_pointer;
+
+empty:
+    return NULL;
+}
+
+/*
+* cpu_cache_push: puts a block in the bin of the CPU the thread runs on, false when the bin is full. Like
+*                 cpu_cache_pop, a restartable sequence committed by its count store
+*/
+bool cpu_cache_push(size_t bin, void* payload_pointer){
+    struct rseq *rs = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+
+restart:
+    __asm__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "movl %[cpu_id], %%eax\n\t"
+        "cmpl %[num_cpus], %%eax\n\t"
+        "jae %l[full]\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[bin], %%rax\n\t"
+        // Write slots[count] (unused until the commit), the count store commits
+        "movq (%%rax), %%rcx\n\t"
+        "cmpq %[capacity], %%rcx\n\t"
+        "jae %l[full]\n\t"
+        "movq %[block], 8(%%rax, %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "jmp %l[restart]\n\t"
+        ".popsection\n\t"
+        :
+        : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id), [num_cpus] "r"(num_cpus),
+          [stride] "r"(TCACHE_BINS * sizeof(struct cpu_bin)), [bin] "r"(cpu_caches + bin),
+          [block] "r"(payload_pointer), [capacity] "i"(TCACHE_COUNT), [sig] "i"(RSEQ_SIG)
+        : "rax", "rcx", "memory", "cc"
+        : restart, full);
+
+    return true;
+
+full:
+    return false;
+}
+#endif
+
+#if SLAB
+/*
+* is_slab: whether payload_pointer is a slot of a slab run (anything in the slab arena's heap slice)
+*/
+bool is_slab(void* payload_pointer){
+    return PtI(payload_pointer) - PtI(slab_base) < MAX_HEAP_SIZE / MEM_HEAPS;
+}
+
+/*
+* run_of: the run holding a slot. Every block of the slab arena is a run (free blocks are whole runs too), so
+*         runs never leave the RUN_SIZE grid that starts at slab_base
+*/
+struct run *run_of(void* payload_pointer){
+    return (struct run*)(slab_base + (PtI(payload_pointer) - PtI(slab_base)) / RUN_SIZE * RUN_SIZE);
+}
+
+/*
+* slab_malloc: hands out the first free slot of a run of the request's slot size
+*/
+void* slab_malloc(size_t size){
+    size_t class = (size - 1) / ALIGNMENT;
+    struct run *run = slab_runs[class];
+    if(run == NULL && (run = new_run(class)) == NULL){
+        return NULL;
+    }
+
+    // First free slot, a run with none left leaves the list
+    size_t word = 0;
+    while(run->free_map[word] == 0){
+        word++;
+    }
+    size_t slot = word * 64 + (size_t)__builtin_ctzll(run->free_map[word]);
+    run->free_map[word] &= run->free_map[word] - 1;
+    if(--run->free_count == 0){
+        unlink_run(run);
+    }
+
+    return (char*)run + RUN_HEADER_SIZE + slot * run->slot_size;
+}
+
+/*
+* slab_free: marks the slot free, an empty run goes back to the slab arena
+*/
+void slab_free(void* payload_pointer){
+    struct run *run = run_of(payload_pointer);
+    size_t slot = (size_t)((char*)payload_pointer - (char*)run - RUN_HEADER_SIZE) / run->slot_size;
+    uint64_t bit = (uint64_t)1 << (slot % 64);
+    if(run->free_map[slot / 64] & bit){ // already free
+        return;
+    }
+    run->free_map[slot / 64] |= bit;
+
+    // A full run gets a free slot: back on its list
+    size_t class = run->slot_size / ALIGNMENT - 1;
+    if(run->free_count++ == 0){
+        run->prev = NULL;
+        run->next = slab_runs[class];
+        if(run->next != NULL){
+            run->next->prev = run;
+        }
+        slab_runs[class] = run;
+    }
+
+    // An empty run is released right away, so the slab arena shrinks instead of holding on to it
+    if(run->free_count == RUN_SLOTS_SIZE / run->slot_size){
+        unlink_run(run);
+        release_run(run);
+    }
+}
+
+/*
+* slab_realloc: keeps the slot while the request fits it, else moves the payload to a new block (through malloc,
+*               so a size that still fits a larger slot class gets a slot)
+*/
+void* slab_realloc(void* oldptr, size_t size){
+    if(size == 0){
+        slab_free(oldptr);
+        return NULL;
+    }
+
+    size_t slot_size = run_of(oldptr)->slot_size;
+    if(size <= slot_size){
+        return oldptr;
+    }
+
+    void* newptr = malloc(size);
+    if(newptr != NULL){
+        memcpy(newptr, oldptr, slot_size);
+        slab_free(oldptr);
+    }
+    return newptr;
+}
+
+/*
+* new_run: allocates a run for slots of the class's size from the slab arena and puts it on the class's list
+*/
+struct run *new_run(size_t class){
+    struct arena *heap_arena = arena;
+    arena = (struct arena*)mem_heap_lo_at(SLAB_HEAP);
+    struct run *run = allocate_block(RUN_SIZE);
+    arena = heap_arena;
+    if(run == NULL){
+        return NULL;
+    }
+
+    // Every slot starts free
+    run->slot_size = (uint32_t)((class + 1) * ALIGNMENT);
+    run->free_count = (uint32_t)(RUN_SLOTS_SIZE / run->slot_size);
+    for(size_t word = 0; word < 4; word++){
+        size_t slots = (run->free_count > word * 64) ? run->free_count - word * 64 : 0;
+        run->free_map[word] = (slots >= 64) ? ~(uint64_t)0 : ((uint64_t)1 << slots) - 1;
+    }
+
+    run->prev = NULL;
+    run->next = NULL;
+    slab_runs[class] = run;
+
+    return run;
+}
+
+/*
+* release_run: gives an empty run back to the slab arena
+*/
+void release_run(struct run *run){
+    struct arena *heap_arena = arena;
+    arena = (struct arena*)mem_heap_lo_at(SLAB_HEAP);
+    free_block(run, RUN_SIZE);
+
+    // Runs are the only blocks here, so a free top of the slab arena is not worth keeping for the next one
+    trim_heap(0);
+    arena = heap_arena;
+}
+
+/*
+* unlink_run: takes a run off the list of its slot size
+*/
+void unlink_run(struct run *run){
+    if(run->prev != NULL){
+        run->prev->next = run->next;
+    }else{
+        slab_runs[run->slot_size / ALIGNMENT - 1] = run->next;
+    }
+    if(run->next != NULL){
+        run->next->prev = run->prev;
+    }
+    run->next = NULL;
+    run->prev = NULL;
+}
+#endif
+
+/*
+ * calloc
+ * This function is not tested by mdriver, and has been implemented for you.
+ */
+void* calloc(size_t nmemb, size_t size)
+{
+    size *= nmemb;
+#if THREAD_SAFE
+    void* ptr;
+
+    // Small requests come from the thread's cache, the rest from the home arena under its lock
+    if (size <= TCACHE_MAX_BLOCK - 8) {
+        ptr = malloc(size);
+        if (ptr) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+    arena = home_arena();
+    pthread_mutex_lock(&arena->lock);
+    drain_remote_frees();
+    ptr = heap_calloc(size);
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+#else
+#if SLAB
+    if (size != 0 && size <= SLAB_MAX_SIZE) { // slots have no header
+        void* ptr = slab_malloc(size);
+        if (ptr) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+#endif
+    return heap_calloc(size);
+#endif
+}
+
+/*
+* heap_calloc: calloc on the current arena (a THREAD_SAFE build holds its lock). A fresh mapping is already zero,
+*              and so is the part of a block place took from a purged block's interior
+*/
+void* heap_calloc(size_t size){
+#if PURGE
+    arena->zero_lo = NULL;
+    arena->zero_hi = NULL;
+#endif
+    char* ptr = heap_malloc(size);
+    if (ptr == NULL || (get(GHA(ptr)) & MAPPED)) {
+        return ptr;
+    }
+
+#if PURGE
+    // Clear around the zero range (it lies inside the block, but may end past the size bytes asked for)
+    char* end = ptr + size;
+    if (arena->zero_lo != NULL && arena->zero_lo < end) {
+        memset(ptr, 0, arena->zero_lo - ptr);
+        if (arena->zero_hi < end) {
+            memset(arena->zero_hi, 0, end - arena->zero_hi);
+        }
+        return ptr;
+    }
+#endif
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+/*
+ * Returns whether the pointer is in the heap.
+ * May be useful for debugging.
+ */
+static bool in_heap(const void* p)
+{
+    return p <= mem_heap_hi_at(arena->id) && p >= mem_heap_lo_at(arena->id);
+}
+
+/*
+ * Returns whether the pointer is aligned.
+ * May be useful for debugging.
+ */
+static bool aligned(const void* p)
+{
+    size_t ip = (size_t) p;
+    return align(ip) == ip;
+}
+
+/*
+ * mm_checkheap
+ */
+bool mm_checkheap(int lineno)
+{
+#ifdef DEBUG
+    dbg_printf("\nChecking Heap...\n");
+
+    // TOH is the free block at the top of the heap, or the epilogue when the top block is allocated
+    char* epilogue = (char*)mem_heap_hi_at(arena->id) + 1;
+    if((arena->TOH != epilogue && (get_alloc(GHA(arena->TOH)) || next_blk(arena->TOH) != epilogue)) ||
+       (arena->TOH == epilogue && !get_prev_alloc(GHA(epilogue)))){
+        dbg_printf("Check heap: TOH %p is not the top free block or the epilogue at line %d\n", arena->TOH, lineno);
+        return false;
+    }
+
+    // Checks every size class
+    for(size_t class = 0; class < NUM_CLASSES; class++){
+
+        // Vars for checking free list 
+        char* sentinel = list_sentinel(class);
+        char* next_free = get_succ(sentinel);
+        char* pred = sentinel;
+
+        // An empty class must be clear in the bitmap
+        if(next_free == sentinel && class_nonempty(class)){
+            dbg_printf("Check heap: class %zu is empty but set in the bitmap at line %d\n", class, lineno);
+            return false;
+        }
+
+        // Checks the free list
+        while(next_free != sentinel){
+
+            // Check free list
+            if(!in_heap(next_free)){
+                dbg_printf("free block (%p) is not in heap at line %d\n", next_free, lineno);
+                return false;
+            }
+
+            // Check each free block is actualy freed
+            if(get_alloc(GHA(next_free)) != 0){
+                dbg_printf("Check heap: address %p is currently allocated and pointed to by %p\n", next_free, pred);
+                return false;
+            }
+
+            // Check the bitmap agrees with the list
+            if(!class_nonempty(class)){
+                dbg_printf("Check heap: class %zu is non-empty but clear in the bitmap at line %d\n", class, lineno);
+                return false;
+            }
+
+            // Check the block is filed under the right class
+            if(size_class(get_size(GHA(next_free))) != class){
+                dbg_printf("Check heap: block %p of size %zu is in class %zu at line %d\n", next_free, get_size(GHA(next_free)), class, lineno);
+                return false;
+            }
+
+            // Check the links agree in both directions
+            if(get_pred(next_free) != pred){
+                dbg_printf("pred(%p) = %p, expected %p at line %d\n", next_free, get_pred(next_free), pred, lineno);
+                return false;
+            }
+
+            // Headers and footers match (the footer does not track the prev mini and purged bits, mini blocks have none)
+            if(get_size(GHA(next_free)) != MINI_BLOCK_SIZE && (get(GHA(next_free)) & ~(size_t)(PREV_MINI | PURGED)) != get(GFA(next_free))){
+                dbg_printf("Header and footer of payload pointer %p do not match at line %d\n", next_free, lineno);
+                return false;
+            }
+
+            // The next block must know this block is free (and whether it is a mini block)
+            if(get_prev_alloc(GHA(next_blk(next_free))) ||
+               ((get(GHA(next_blk(next_free))) & PREV_MINI) != 0) != (get_size(GHA(next_free)) == MINI_BLOCK_SIZE)){
+                dbg_printf("Block after free block %p has wrong prev bits at line %d\n", next_free, lineno);
+                return false;
+            }
+
+            // go to next free block
+            pred = next_free;
+            next_free = get_succ(next_free);
+        }
+
+        // The list closes back on the sentinel
+        if(get_pred(sentinel) != pred){
+            dbg_printf("Check heap: sentinel of class %zu has pred %p, expected %p at line %d\n", class, get_pred(sentinel), pred, lineno);
+            return false;
+        }
+    }
+
+#if TREE_MIN_BLOCK
+    // Checks the tree of large free blocks
+    if(!tree_check(arena->tree_root, TREE_MIN_BLOCK, NULL, SIZE_MAX, NULL, lineno)){
+        return false;
+    }
+#endif
+
+#if QUICK_BINS
+    // Checks the quick lists: allocated blocks of the list's size
+    for(size_t bin = 0; bin < QUICK_BINS; bin++){
+        if((arena->quick_lists[bin] != NULL) != ((arena->quick_map >> bin) & 1)){
+            dbg_printf("Check heap: quick list %zu does not match the bitmap at line %d\n", bin, lineno);
+            return false;
+        }
+        for(char* quick = arena->quick_lists[bin]; quick != NULL; quick = *(char**)quick){
+            if(!in_heap(quick) || !get_alloc(GHA(quick)) || get_size(GHA(quick)) != (bin + 1) * ALIGNMENT){
+                dbg_printf("Check heap: quick list entry %p is not a block of its size at line %d\n", quick, lineno);
+                return false;
+            }
+        }
+    }
+#endif
+
+#if DEFERRED_COALESCING
+    // Checks the pending buffer: allocated blocks
+    for(size_t i = 0; i < arena->pending_count; i++){
+        if(!in_heap(arena->pending[i]) || !get_alloc(GHA(arena->pending[i]))){
+            dbg_printf("Check heap: pending block %p is not an allocated block at line %d\n", arena->pending[i], lineno);
+            return false;
+        }
+    }
+#endif
+
+#if SLAB
+    // Checks the slab runs with free slots
+    for(size_t class = 0; class < SLAB_CLASSES; class++){
+        for(struct run *run = slab_runs[class]; run != NULL; run = run->next){
+            size_t free_slots = 0;
+            for(size_t word = 0; word < 4; word++){
+                free_slots += (size_t)__builtin_popcountll(run->free_map[word]);
+            }
+            if(!is_slab(run) || run_of(run) != run || run->slot_size != (class + 1) * ALIGNMENT ||
+               run->free_count == 0 || run->free_count != free_slots){
+                dbg_printf("Check heap: slab run %p of class %zu is inconsistent at line %d\n", (void*)run, class, lineno);
+                return false;
+            }
+        }
+    }
+#endif
+
+    // // Check allocated blocks (not needed right now)
+    // while(next_allocated != mem_heap_hi() + 1){
+    //     // Get the next block
+    //     void* next_block = next_blk(next_allocated);
+    //     if(get_alloc(GHA(next_block))){
+    //         if((char*)next_block - 8 < (next_allocated + get_size(GHA(next_allocated)))){
+    //             dbg_printf("Overlapping allocated bytes");
+    //         }
+    //     }
+    //     next_allocated = next_block;
+    // }
+
+    dbg_printf("Heap is consistent at line %d\n", lineno);
+#endif /* DEBUG */
+    return true;
+}
+
+/*
+* allocate_page: Allocates a page and coalesces 
+*/
+bool allocate_page(size_t page_size){
+
+    // 1/32 MiB
+    // size_t page_size = 32768;
+
+    // Allocate a page (page_size bytes);
+    void *payload_pointer = mem_sbrk_at(arena->id, page_size); // mem-brk returns a PP in this implimentation
+
+    // Initial allocation failed
+    if(payload_pointer == (void*)-1){
+        printf("Page allocation failed: heap size %zu/%llu bytes\n", mem_heapsize_at(arena->id) + page_size, MAX_HEAP_SIZE / MEM_HEAPS);
+        return false;
+    }
+
+    // Set footer and header blocks for the new free block
+    put(GHA(payload_pointer), pack(page_size, 0, 0) | (get(GHA(payload_pointer)) & (PREV_ALLOC | PREV_MINI))); // Overwrites old epilogue header
+    put(GFA(payload_pointer), get(GHA(payload_pointer)));
+
+    // Set new epilogue header
+    put(GHA(next_blk(payload_pointer)), pack(0, 1, 0));
+    
+    // Update TOH 
+    arena->TOH = coalesce(payload_pointer);
+
+    return true;
+}
+
+/*
+* grow_heap: grows the heap so the block at TOH can hold block_size bytes, with one mem_sbrk call
+*   - The extension is exactly the shortfall, so it scales with the request and adds no slack to the peak heap
+*/
+bool grow_heap(size_t block_size){
+
+    // Only the shortfall over the free block at the top of the heap is needed, there is none when it fits
+    size_t top_free = get_alloc(GHA(arena->TOH)) ? 0 : get_size(GHA(arena->TOH));
+    if(top_free >= block_size){
+        return true;
+    }
+    return allocate_page(align(block_size - top_free));
+}
+
+/*
+* map_block: serves a huge request from its own memlib region, the header sits 8 bytes into the region
+*/
+void* map_block(size_t size){
+    size_t page = mem_pagesize();
+
+    // A size this close to SIZE_MAX would wrap around when the header is added and it is rounded up
+    if(size > SIZE_MAX - 16 - page){
+        return NULL;
+    }
+    size_t region_size = (size + 16 + page - 1) & ~(page - 1);
+
+    char* region = mem_map(region_size);
+    if(region == NULL){
+        return NULL;
+    }
+    put(region + 8, pack(region_size, 1, 1) | MAPPED);
+
+    return region + 16;
+}
+
+/*
+* remap_block: resizes a mapped block with mem_remap, so its pages move instead of its bytes
+*/
+void* remap_block(void* payload_pointer, size_t size){
+    size_t page = mem_pagesize();
+
+    // A size this close to SIZE_MAX would wrap around when the header is added and it is rounded up
+    if(size > SIZE_MAX - 16 - page){
+        return NULL;
+    }
+    size_t region_size = (size + 16 + page - 1) & ~(page - 1);
+    size_t old_size = get_size(GHA(payload_pointer));
+
+    if(region_size == old_size){
+        return payload_pointer;
+    }
+
+    char* region = mem_remap((char*)payload_pointer - 16, old_size, region_size);
+    if(region == NULL){
+        return NULL;
+    }
+    put(region + 8, pack(region_size, 1, 1) | MAPPED);
+
+    return region + 16;
+}
+
+/*
+* move_to_top: allocates block_size bytes at the top of the heap at the same offset within a page as
+*              payload_pointer, moves the payload's whole pages there with mem_move_pages (copying only
+*              the partial pages at both ends) and frees the old block. Returns the new payload pointer
+*/
+void* move_to_top(void* payload_pointer, size_t block_size){
+    size_t page = mem_pagesize();
+    size_t old_payload = get_size(GHA(payload_pointer)) - 8;
+
+    // Bytes to skip at the top so the new payload lands at the old one's page offset (a skipped gap needs a block).
+    // The top free block has to hold the gap and the new block, and growing the heap can move TOH (the new page
+    // coalesces with the block before it), so the gap is computed again after every growth
+    size_t gap;
+    while(true){
+        gap = (PtI(payload_pointer) - PtI(arena->TOH)) & (page - 1);
+        if(gap != 0 && gap < MINI_BLOCK_SIZE){
+            gap += page;
+        }
+
+        size_t top_free = get_alloc(GHA(arena->TOH)) ? 0 : get_size(GHA(arena->TOH));
+        if(top_free >= gap + block_size){
+            break;
+        }
+        if(!grow_heap(gap + block_size)){
+            return NULL;
+        }
+    }
+
+    // Allocate the gap and the new block from the top block
+    char* gap_pointer = arena->TOH;
+    if(gap != 0){
+        arena->TOH += place(gap_pointer, gap);
+    }
+    char* newptr = arena->TOH;
+    arena->TOH += place(newptr, block_size);
+
+    // Copy the partial pages, move the whole ones (or copy everything when the pages cannot be moved)
+    size_t head = ((PtI(payload_pointer) + page - 1) & ~(page - 1)) - PtI(payload_pointer);
+    size_t pages = (old_payload > head) ? (old_payload - head) & ~(page - 1) : 0;
+    if(pages == 0 || !mem_move_pages(newptr + head, (char*)payload_pointer + head, pages)){
+        head = 0;
+        pages = 0;
+    }
+    memcpy(newptr, payload_pointer, head);
+    memcpy(newptr + head + pages, (char*)payload_pointer + head + pages, old_payload - head - pages);
+
+    if(gap != 0){
+        heap_free(gap_pointer);
+    }
+    heap_free(payload_pointer);
+
+    return newptr;
 }
 
 /*
 * Pack: create a value for the header/footer
 */
-size_t pack(size_t size, int alloc){
-    // Bitwise or size and alloc into one 8 byte number
-    return (size | alloc);
+size_t pack(size_t size, int alloc, int prev_alloc){
+    // Bitwise or size, alloc and prev alloc into one 8 byte number
+    return (size | alloc | (prev_alloc ? PREV_ALLOC : 0));
 }
 
 /*
@@ -460,14 +2295,20 @@ void *GFA(void *payload_pointer){
 *   - Used in conjuction with get_size & get_alloc
 */
 size_t get(void *addr){
+#if THREAD_SAFE
+    // free reads a header without the lock while its arena's owner may rewrite the prev bits (relaxed is enough,
+    // the size and alloc bit a reader relies on only change while the block belongs to it)
+    return __atomic_load_n((size_t *)addr, __ATOMIC_RELAXED);
+#else
     return(*(size_t *)addr);
+#endif
 }
 
 /*
 * get_size: gets the size of a header/footer in bytes
 */
 size_t get_size(void *addr){
-    return(get(addr) & ~0xF); 
+    return(get(addr) & ~(MAPPED | 0xF)); 
 }
 
 /*
@@ -477,17 +2318,52 @@ int get_alloc(void *addr){
     return(get(addr) & 0x1);
 }
 
+/*
+* get_prev_alloc: returns if the block before the addr block is allocated
+*/
+int get_prev_alloc(void *addr){
+    return((get(addr) & PREV_ALLOC) != 0);
+}
+
+/*
+* set_prev: updates the prev allocated and prev mini bits in the header of payload_pointer's block
+*/
+void set_prev(void *payload_pointer, int prev_alloc, size_t prev_size){
+    size_t header = get(GHA(payload_pointer)) & ~(size_t)(PREV_ALLOC | PREV_MINI);
+    header |= prev_alloc ? PREV_ALLOC : 0;
+    header |= (prev_size == MINI_BLOCK_SIZE) ? PREV_MINI : 0;
+    put(GHA(payload_pointer), header);
+}
+
+/*
+* block_size_of: size of the block holding a size byte payload (header + payload, alligned)
+*/
+size_t block_size_of(size_t size){
+    return align(size + 8);
+}
+
 /*
 * put: puts a header/footer value at addr
 */ 
 void put(void* addr, size_t val){
+#if THREAD_SAFE
+    // Paired with the unlocked read in get
+    __atomic_store_n((size_t *)addr, val, __ATOMIC_RELAXED);
+#else
     *(size_t *)addr = val;
+#endif
 }
 
 /*
 * prev_fblk: gets the address of the previous free blocks payload pointer
+*   - Only valid when the previous block is free (allocated blocks have no footer)
 */
 char *prev_blk(void* payload_pointer){
+    // A free mini block has no footer, the header says it is there
+    if(get(GHA(payload_pointer)) & PREV_MINI){
+        return((char*)payload_pointer - MINI_BLOCK_SIZE);
+    }
+
     // Subtract boundry tag from original payload pointer
     return((char*)payload_pointer - get_size((char*)payload_pointer - 16));
 }
@@ -501,362 +2377,668 @@ char *next_blk(void* payload_pointer){
 }
 
 /*
-* coalesce: merges adjacent free blocks, returns the payload pointer
+* coalesce: merges adjacent free blocks, inserts the result into its size class, returns the payload pointer
 */
 void* coalesce(void *payload_pointer){
 
     dbg_printf("Stepping into coalesce:");
 
     // Get allocation about sourround blocks
-    size_t prev_block = get_alloc(GFA(prev_blk(payload_pointer)));
+    size_t prev_block = get_prev_alloc(GHA(payload_pointer));
     size_t next_block = get_alloc(GHA(next_blk(payload_pointer)));
     size_t block_size = get_size(GHA(payload_pointer));
 
-    // Save old information
-    void* old_payload_succ;
-    void* old_payload_pred;
+    // next not allocated: absorb it
+    if(!next_block){
+        dbg_printf("Coalesce with next block\n");
+        remove_free_block(next_blk(payload_pointer));
+        block_size += get_size(GHA(next_blk(payload_pointer)));
+    }
+
+    // prev not allocated: absorb into it
+    if(!prev_block){
+        dbg_printf("Coalesce with previous block\n");
+        payload_pointer = prev_blk(payload_pointer);
+        remove_free_block(payload_pointer);
+        block_size += get_size(GHA(payload_pointer));
+    }
+
+    // Update block information (the block before a coalesced block is always allocated, mini blocks have no footer)
+    put(GHA(payload_pointer), pack(block_size, 0, 1) | (get(GHA(payload_pointer)) & PREV_MINI));
+    if(block_size != MINI_BLOCK_SIZE){
+        put(GFA(payload_pointer), pack(block_size, 0, 1));
+    }
+    set_prev(next_blk(payload_pointer), 0, block_size);
+
+    // A large free block starts its purge decay now (the stamp lives after pred and succ)
+    if(block_size >= PURGE_THRESHOLD){
+        put((char*)payload_pointer + 8, arena->op_clock);
+    }
 
-    // prev and next, allocated 
-    if(prev_block && next_block){
+    // Push the merged block onto its size class (the heap is checked by the caller, which may still move TOH)
+    insert_free_block(payload_pointer);
 
-        dbg_printf("Coalesce Block 1\n");
+    return(payload_pointer);
+}
 
-        // Update free list
-        if(free_root != NULL){ 
-            // Its never possibly for a newly freed block to be the free root
-            put(payload_pointer, PtI(NULL)); // pred
-            put((char*)payload_pointer + 8, PtI(free_root)); // succ
-            put(free_root, PtI(payload_pointer)); // pred       
-        }else{ // i.e the first allocate_page()
-            put(payload_pointer, PtI(NULL)); // pred
-            put((char*)payload_pointer + 8, PtI(NULL)); // pred
-        }
-   
-        // Update the free root
-        free_root = payload_pointer;
+/*
+* place: places a block of block_size at payload_pointer most effectivley
+*/
+size_t place(void* payload_pointer, size_t block_size){
+
+    dbg_printf("\nStepping into place:\n");
+
+    // The block is leaving its size class either way (the header is free here, so bit 3 means PURGED, split_block
+    // writes an allocated header without it and realloc alone sets it again, as GROWN)
+    bool purged = (get(GHA(payload_pointer)) & PURGED) != 0;
+    size_t old_size = get_size(GHA(payload_pointer));
+    remove_free_block(payload_pointer);
 
-        mm_checkheap(__LINE__);
+    size_t allocated_size = split_block(payload_pointer, old_size, block_size);
 
-        return(payload_pointer);
+    // The remainder's interior is part of the purged interior, it does not need purging again
+    if(purged && get_alloc(GHA(next_blk(payload_pointer))) == 0){
+        put(GHA(next_blk(payload_pointer)), get(GHA(next_blk(payload_pointer))) | PURGED);
     }
 
-    // prev allocated, next not allocated
-    else if(prev_block && !next_block){
+#if PURGE
+    // The purged interior still reads zero up to the allocated payload's end, calloc does not clear it again
+    if(purged){
+        size_t page = mem_pagesize();
+        size_t lo = (PtI(payload_pointer) + 16 + page - 1) & ~(page - 1);
+        size_t hi = (PtI(payload_pointer) + old_size - 16) & ~(page - 1);
+        if(hi > PtI(payload_pointer) + allocated_size - 8){
+            hi = PtI(payload_pointer) + allocated_size - 8;
+        }
+        if(lo < hi){
+            arena->zero_lo = ItP(lo);
+            arena->zero_hi = ItP(hi);
+        }
+    }
+#endif
 
-        dbg_printf("Coalesce Block 2\n");
+    return allocated_size;
+}
 
-        // Save next blocks payload pointer's old successor and predeseccor
-        old_payload_succ = ItP(get(next_blk(payload_pointer) + 8)); // succ
-        old_payload_pred = ItP(get(next_blk(payload_pointer))); // pred
-        void* old_next_blk = next_blk(payload_pointer);
+/*
+* split_block: allocates block_size bytes of the unlisted old_size byte block at payload_pointer, the rest
+*              becomes a free block if it can hold a mini block. Returns the allocated size
+*/
+size_t split_block(void* payload_pointer, size_t old_size, size_t block_size){
 
-        // Update block information
-        block_size += get_size(GHA(next_blk(payload_pointer)));
-        put(GHA(payload_pointer), pack(block_size, 0));
-        put(GFA(payload_pointer), pack(block_size, 0));
-
-        // Update linked list
-        if(old_next_blk != free_root){
-            put(payload_pointer, PtI(NULL)); // pred
-            put((char*)payload_pointer + 8, PtI(free_root)); // succ
-            put(free_root, PtI(payload_pointer)); // pred
-            put((char*)old_payload_pred + 8, PtI(old_payload_succ));
-            if(old_payload_succ != NULL){ 
-                put(old_payload_succ, PtI(old_payload_pred)); // pred
-            }
-        }else{ 
-            put(payload_pointer, PtI(NULL)); // pred
-            put((char*)payload_pointer + 8, PtI(old_payload_succ)); // succ
-            if(old_payload_succ != NULL){ 
-                put(old_payload_succ, PtI(payload_pointer)); // pred
-            }
+    size_t remainder = old_size - block_size;
+    size_t prev_bits = get(GHA(payload_pointer)) & (PREV_ALLOC | PREV_MINI);
+
+    // If the remaining block is going to be smaller than the minimum block size
+    if(remainder < MINI_BLOCK_SIZE){
+        // set the header of the whole allocated block, the next block's prev is now allocated
+        put(GHA(payload_pointer), pack(old_size, 1, 0) | prev_bits);
+        set_prev(next_blk(payload_pointer), 1, old_size);
+
+        return old_size;
+    }else{ // Only split if remainder >= MINI_BLOCK_SIZE
+
+        // set the header of the just the allocated block
+        put(GHA(payload_pointer), pack(block_size, 1, 0) | prev_bits);
+
+        // Set header and footer for un-used bytes (a mini remainder has no footer)
+        put(GHA(next_blk(payload_pointer)), pack(remainder, 0, 1)); 
+        set_prev(next_blk(payload_pointer), 1, block_size);
+        if(remainder != MINI_BLOCK_SIZE){
+            put(GFA(next_blk(payload_pointer)), pack(remainder, 0, 1));
         }
+        set_prev(next_blk(next_blk(payload_pointer)), 0, remainder);
+        if(remainder >= PURGE_THRESHOLD){
+            put(next_blk(payload_pointer) + 8, arena->op_clock);
+        }
+
+        // Remainder goes to the front of its own size class
+        insert_free_block(next_blk(payload_pointer));
+        
+        return block_size;
+    }
+} 
+
+/*
+* purge_free_blocks: releases the page aligned interior of every free block of at least PURGE_THRESHOLD bytes
+*                    that has been free for PURGE_DECAY requests, and marks it PURGED so it is done once
+*/
+void purge_free_blocks(void){
+    size_t page = mem_pagesize();
 
-        // Update the free root
-        free_root = payload_pointer;
+    for(size_t class = size_class(PURGE_THRESHOLD); class < NUM_CLASSES; class++){
+        for(char* block = get_succ(list_sentinel(class)); block != list_sentinel(class); block = get_succ(block)){
+            purge_block(block, page);
+        }
+    }
 
-        mm_checkheap(__LINE__);
+#if TREE_MIN_BLOCK
+    // The tree in key order from PURGE_THRESHOLD up (purging keeps the size, so the key does not move)
+    for(char* block = tree_lower_bound(PURGE_THRESHOLD, NULL); block != NULL; block = tree_lower_bound(get_size(GHA(block)), block + 1)){
+        purge_block(block, page);
     }
+#endif
+}
 
-    // prev not allocated, next allocated (allocate page)
-    else if(!prev_block && next_block){  
+/*
+* purge_block: purges a free block for purge_free_blocks, unless it is too small, already purged or still hot
+*/
+void purge_block(char* block, size_t page){
+    size_t size = get_size(GHA(block));
 
-        dbg_printf("Coalesce Block 3\n");
+    // Too small, already purged or still hot
+    if(size < PURGE_THRESHOLD || (get(GHA(block)) & PURGED) || arena->op_clock - get(block + 8) < PURGE_DECAY){
+        return;
+    }
 
-        // Update block information
-        block_size += get_size(GHA(prev_blk(payload_pointer)));
-        put(GFA(payload_pointer), pack(block_size,0));
-        put(GHA(prev_blk(payload_pointer)), pack(block_size, 0));
-        payload_pointer = prev_blk(payload_pointer);
+    // Keep the links, the stamp and the footer
+    size_t lo = (PtI(block) + 16 + page - 1) & ~(page - 1);
+    size_t hi = PtI(GFA(block)) & ~(page - 1);
+    if(lo < hi && mem_purge(ItP(lo), hi - lo)){
+        put(GHA(block), get(GHA(block)) | PURGED);
+    }
+}
+
+#if TLSF
+/*
+* find_fit: TLSF good fit, the first TLSF_SCAN blocks of the request's own class are checked for the
+*           tightest fit, then the request is rounded up to the next second level boundary so that every
+*           block of the class found fits, and the class is found with two find-first-sets (no list walk)
+*/
+void* find_fit(size_t block_size){
 
-        // Save payload pointers old successor and predeseccor
-        old_payload_succ = ItP(get(((char*)payload_pointer + 8))); // succ
-        old_payload_pred = ItP(get(payload_pointer)); // pred
-
-        // Update linked list
-        if(payload_pointer != free_root){
-            put(payload_pointer, PtI(NULL)); // pred
-            put((char*)payload_pointer + 8, PtI(free_root)); // succ
-            put(free_root, PtI(payload_pointer)); // pred
-            put((char*)old_payload_pred + 8, PtI(old_payload_succ));
-            if(old_payload_succ != NULL){ 
-                put(old_payload_succ, PtI(old_payload_pred)); // pred
+    // A bounded walk of block_size's own class lets equal and near sized blocks be recycled
+    char* sentinel = list_sentinel(size_class(block_size));
+    char* best = NULL;
+    size_t scanned = 0;
+    for(char* block = get_succ(sentinel); block != sentinel && scanned < TLSF_SCAN; block = get_succ(block), scanned++){
+        size_t size = get_size(GHA(block));
+        if(size >= block_size && (best == NULL || size < get_size(GHA(best)))){
+            best = block;
+            if(size == block_size){
+                break;
             }
         }
+    }
+    if(best != NULL){
+        return (void*)best;
+    }
 
-        // Update the free root
-        free_root = payload_pointer;
+    // Round up to the next second level step so any block of the resulting class is large enough
+    size_t fl = (size_t)(63 - __builtin_clzll(block_size));
+    size_t rounded = block_size + (1ULL << (fl - SL_LOG2)) - 1;
+    fl = (size_t)(63 - __builtin_clzll(rounded));
+    size_t sl = (rounded >> (fl - SL_LOG2)) & (SL_COUNT - 1);
+    fl -= FL_SHIFT;
 
-        mm_checkheap(__LINE__);
+    if(fl >= FL_COUNT){
+        return NULL;
     }
 
-    // prev and next, not allocated
-    else{   
+    // Non-empty second levels at or above sl within the same first level
+    uint64_t sl_map = sl_maps()[fl] & (~0ULL << sl);
+    if(sl_map == 0){
+        // Otherwise the smallest non-empty first level above fl
+        uint64_t fl_map = (fl + 1 < FL_COUNT) ? arena->class_map & (~0ULL << (fl + 1)) : 0;
+        if(fl_map == 0){
+            return NULL;
+        }
+        fl = (size_t)__builtin_ctzll(fl_map);
+        sl_map = sl_maps()[fl];
+    }
 
-        dbg_printf("Coalesce Block 4\n");
+    return (void*)get_succ(list_sentinel(tlsf_class(fl, (size_t)__builtin_ctzll(sl_map))));
+}
 
-        // Save old pred/succ of next_block
-        void* old_payload_succ_right = ItP(get(next_blk(payload_pointer) + 8)); // succ
-        void* old_payload_pred_right = ItP(get(next_blk(payload_pointer))); // pred
-        void* right_free_block = next_blk(payload_pointer);
+/*
+* size_class: maps a block size to its (first level, second level) list index
+*   - First level fl holds [2^(fl+4), 2^(fl+5)), split into SL_COUNT linear ranges
+*/
+size_t size_class(size_t block_size){
+    size_t fl = (size_t)(63 - __builtin_clzll(block_size));
+    size_t sl = (block_size >> (fl - SL_LOG2)) & (SL_COUNT - 1);
 
-        // Update block information
-        block_size += get_size(GHA(prev_blk(payload_pointer))) + get_size(GFA(next_blk(payload_pointer)));
-        put(GHA(prev_blk(payload_pointer)), pack(block_size,0));
-        put(GFA(next_blk(payload_pointer)), pack(block_size,0));
-        payload_pointer = prev_blk(payload_pointer);
+    return tlsf_class(fl - FL_SHIFT, sl);
+}
 
-        // Save old pred/succ of prev_block
-        old_payload_pred = ItP(*(size_t*)payload_pointer); // pred
-        old_payload_succ = ItP(*(size_t*)((char*)payload_pointer + 8)); // succ
-        
-        /* Case 1: Neither prev or next are the free root*/
-        if(payload_pointer != free_root && right_free_block != free_root) {
-
-            // Update linked list after to preserve order 
-            put(payload_pointer, PtI(NULL)); // pred
-            put((char*)payload_pointer + 8, PtI(free_root));// succ
-            put(free_root, PtI(payload_pointer)); // pred
-
-            // Check if the left blocks successor is the right block
-            if(old_payload_succ == right_free_block){
-                put((char*)old_payload_pred + 8, PtI(old_payload_succ_right));// succ
-                if(old_payload_succ_right != NULL){
-                    put(old_payload_succ_right, PtI(old_payload_pred));// succ
-                } 
-            }
+/*
+* tlsf_class: index of the list for first level fl and second level sl
+*/
+size_t tlsf_class(size_t fl, size_t sl){
+    return fl * SL_COUNT + sl;
+}
 
-            // Check if the right blocks successor is the left block
-            else if(old_payload_succ_right == payload_pointer){
-                put((char*)old_payload_pred_right + 8, PtI(old_payload_succ));// succ
-                if(old_payload_succ != NULL){
-                    put(old_payload_succ, PtI(old_payload_pred_right));// succ
-                } 
-            }
+/*
+* sl_maps: the second level bitmaps, one byte per first level, stored right after the class sentinels
+*/
+uint8_t *sl_maps(void){
+    return (uint8_t*)(arena->sentinels + NUM_CLASSES * SENTINEL_SIZE);
+}
+
+/*
+* class_nonempty: returns whether the bitmaps say size class class has free blocks
+*/
+bool class_nonempty(size_t class){
+    return (sl_maps()[class / SL_COUNT] >> (class % SL_COUNT)) & 1;
+}
+#else
+/*
+* find_fit: finds a fit in the smallest non-empty size class that can hold block_size,
+*           following FIT_POLICY
+*/
+void* find_fit(size_t block_size){
+
+#if TREE_MIN_BLOCK
+    // Large requests only fit blocks in the tree
+    if(block_size >= TREE_MIN_BLOCK){
+        return (void*)tree_lower_bound(block_size, NULL);
+    }
+#endif
+
+    size_t class = size_class(block_size);
+    uint64_t larger = (class + 1 < NUM_CLASSES) ? arena->class_map & (~0ULL << (class + 1)) : 0;
+
+#if FIT_POLICY == FIRST_FIT
+    // The most recently freed block of block_size's own class is the tightest O(1) candidate
+    char* root = get_succ(list_sentinel(class));
+    if(root != list_sentinel(class) && get_size(GHA(root)) >= block_size){
+        return (void*)root;
+    }
+
+    // Fast path: every block in a class above block_size's class fits, so take the root of the
+    // first non-empty one (one find-first-set, independent of how many free blocks exist)
+    if(larger != 0){
+        return (void*)get_succ(list_sentinel((size_t)__builtin_ctzll(larger)));
+    }
+#endif
+
+    // Search block_size's own class, its blocks may be too small. With a larger class to fall back on the walk
+    // looks at FIT_SCAN blocks at most, fitting or not, so a class of small blocks is never walked whole
+    char* fit = tightest_fit(list_sentinel(class), block_size, (larger != 0) ? FIT_SCAN : SIZE_MAX);
+    if(fit != NULL){
+        return (void*)fit;
+    }
+    if(larger == 0){
+#if TREE_MIN_BLOCK
+        // Any block in the tree fits, the smallest (lowest addressed) one is the best
+        return (void*)tree_lower_bound(block_size, NULL);
+#else
+        return NULL;
+#endif
+    }
+
+    // Every block of the first non-empty larger class fits, pick the tightest candidate
+    return tightest_fit(list_sentinel((size_t)__builtin_ctzll(larger)), block_size, FIT_SCAN);
+}
 
-            // Neither block points to the other
-            else{ 
-                // Update left blocks pred/succ
-                put((char*)old_payload_pred + 8, PtI(old_payload_succ));// succ
-                if(old_payload_succ != NULL){
-                    put(old_payload_succ, PtI(old_payload_pred));// pred
-                }  
-
-                // Update right blocks pred/succ
-                put((char*)old_payload_pred_right + 8, PtI(old_payload_succ_right));// succ
-                if(old_payload_succ_right != NULL){
-                    put(old_payload_succ_right, PtI(old_payload_pred_right));// pred
+/*
+* tightest_fit: walks the list of sentinel and returns the smallest block that fits among the
+*               first FIT_CANDIDATES blocks that fit, looking at max_scanned blocks at most (stops
+*               early on an exact fit)
+*/
+void* tightest_fit(char* sentinel, size_t block_size, size_t max_scanned){
+    char* best = NULL;
+    size_t best_size = SIZE_MAX;
+    size_t candidates = 0;
+    size_t scanned = 0;
+
+    for(char* succ = get_succ(sentinel); succ != sentinel && candidates < FIT_CANDIDATES && scanned < max_scanned;
+        succ = get_succ(succ), scanned++){
+        size_t size = get_size(GHA(succ));
+
+        // check if its large enough and tighter than the best so far
+        if(size >= block_size){
+            candidates++;
+            if(size < best_size){
+                best = succ;
+                best_size = size;
+                if(size == block_size){
+                    break;
                 }
             }
         }
+    }
 
-        /*Case 2: The right block is the free root*/
-        else if(right_free_block == free_root){    
+    return (void*)best;
+}
 
-            // Check if the free root point to the left block
-            if(old_payload_succ_right == payload_pointer){
-                // Update linked list
-                put(payload_pointer, PtI(NULL)); // pred
-            }            
-            else{ // succ(FR) != left block
+/*
+* size_class: maps a block size to its segregated list index
+*   - Class 0 holds the mini blocks, class 1 holds [32, 64), ... the last class holds everything larger
+*/
+size_t size_class(size_t block_size){
+    // floor(log2(block_size)) - log2(MINI_BLOCK_SIZE)
+    size_t class = (size_t)(63 - __builtin_clzll(block_size)) - 4;
 
-                // Make left block FR and point it to right blocks successor
-                put(payload_pointer, PtI(NULL)); // pred
-                put(payload_pointer + 8, PtI(old_payload_succ_right)); // pred
-                if(old_payload_succ_right != NULL){
-                    put(old_payload_succ_right, PtI(payload_pointer));// pred
-                }
+    return (class < NUM_CLASSES) ? class : NUM_CLASSES - 1;
+}
 
-                // Update left block
-                put((char*)old_payload_pred + 8, PtI(old_payload_succ));// succ
-                if(old_payload_succ != NULL){
-                    put(old_payload_succ, PtI(old_payload_pred));// pred
-                }  
-            }
-        }
-        
-        /*Case 3: The left block is the free root*/
-        else if(payload_pointer == free_root){
+/*
+* class_nonempty: returns whether the bitmap says size class class has free blocks
+*/
+bool class_nonempty(size_t class){
+    return (arena->class_map >> class) & 1;
+}
+#endif /* TLSF */
 
-            // Check if the free root point to the right block
-            if(old_payload_succ == right_free_block){
+/*
+* insert_free_block: pushes a free block onto the front (LIFO) of its size class
+*/
+void insert_free_block(void* payload_pointer){
+#if TREE_MIN_BLOCK
+    if(get_size(GHA(payload_pointer)) >= TREE_MIN_BLOCK){
+        tree_insert_block(payload_pointer);
+        return;
+    }
+#endif
+
+    // Link in right after the sentinel
+    size_t class = size_class(get_size(GHA(payload_pointer)));
+    char* sentinel = list_sentinel(class);
+    char* succ = get_succ(sentinel);
+
+    set_pred(payload_pointer, sentinel);
+    set_succ(payload_pointer, succ);
+    set_succ(sentinel, payload_pointer);
+    set_pred(succ, payload_pointer);
+
+    // The class is non-empty now
+#if TLSF
+    sl_maps()[class / SL_COUNT] |= 1U << (class % SL_COUNT);
+    arena->class_map |= 1ULL << (class / SL_COUNT);
+#else
+    arena->class_map |= 1ULL << class;
+#endif
+}
 
-                // Update linked list
-                put(payload_pointer, PtI(NULL)); // pred
-                put((char*)payload_pointer + 8, PtI(old_payload_succ_right)); // pred
-                if(old_payload_succ_right != NULL){
-                    put(old_payload_succ_right, PtI(payload_pointer)); // pred
-                }
-            }            
-            else{  // succ(FR) != right-adjacent free block
-
-                // Make left block FR 
-                put(payload_pointer, PtI(NULL)); // pred
-                put(payload_pointer + 8, PtI(old_payload_succ)); // pred
-                if(old_payload_succ != NULL){
-                    put(old_payload_succ, PtI(payload_pointer));// pred
-                }
+/*
+* remove_free_block: unlinks a free block from its size class
+*/
+void remove_free_block(void* payload_pointer){
+#if TREE_MIN_BLOCK
+    if(get_size(GHA(payload_pointer)) >= TREE_MIN_BLOCK){
+        tree_remove_block(payload_pointer);
+        return;
+    }
+#endif
 
-                // Update right blocks pred to point to its succ
-                put((char*)old_payload_pred_right + 8, PtI(old_payload_succ_right));// succ
-                if(old_payload_succ_right != NULL){
-                    put(old_payload_succ_right, PtI(old_payload_pred_right));// pred
-                }  
-            }
-        }
+    char* pred = get_pred(payload_pointer);
+    char* succ = get_succ(payload_pointer);
 
-        // Update the free root
-        free_root = payload_pointer;
+    set_succ(pred, succ);
+    set_pred(succ, pred);
 
-        mm_checkheap(__LINE__);
+    // Removing the last block empties the class: only the sentinel is left, linked to itself
+    if(pred == succ){
+        size_t class = size_class(get_size(GHA(payload_pointer)));
+#if TLSF
+        sl_maps()[class / SL_COUNT] &= ~(1U << (class % SL_COUNT));
+        if(sl_maps()[class / SL_COUNT] == 0){
+            arena->class_map &= ~(1ULL << (class / SL_COUNT));
+        }
+#else
+        arena->class_map &= ~(1ULL << class);
+#endif
     }
+}
 
-    return(payload_pointer);
+#if TREE_MIN_BLOCK
+/*
+* tree_before: whether the key (size, address) orders before the key of node
+*/
+bool tree_before(size_t size, char* address, char* node){
+    size_t node_size = get_size(GHA(node));
+    return size < node_size || (size == node_size && address < node);
 }
 
 /*
-* place: places a block of block_size at payload_pointer most effectivley
+* tree_left: left child of a tree node, the links sit where a listed block keeps pred and succ (link 0, the
+*            arena itself, is never a block and stands for NULL)
 */
-size_t place(void* payload_pointer, size_t block_size){
+char *tree_left(char* node){
+    uint32_t link = ((uint32_t*)node)[0];
+    return (link == 0) ? NULL : link_block(link);
+}
 
-    dbg_printf("\nStepping into place:\n");
+/*
+* tree_right: right child of a tree node
+*/
+char *tree_right(char* node){
+    uint32_t link = ((uint32_t*)node)[1];
+    return (link == 0) ? NULL : link_block(link);
+}
 
-    // Save old information
-    size_t old_size = get_size(GHA(payload_pointer));
-    size_t remainder = old_size - block_size;
+/*
+* set_tree_left: sets the left child of a tree node
+*/
+void set_tree_left(char* node, char* left){
+    ((uint32_t*)node)[0] = (left == NULL) ? 0 : block_link(left);
+}
+
+/*
+* set_tree_right: sets the right child of a tree node
+*/
+void set_tree_right(char* node, char* right){
+    ((uint32_t*)node)[1] = (right == NULL) ? 0 : block_link(right);
+}
 
-    // Save next blocks payload pointer's old successor and predeseccor
-    void* old_payload_succ = ItP(get((char*)payload_pointer + 8));
-    void* old_payload_pred = ItP(get(payload_pointer));
+/*
+* tree_splay: top down splay of the subtree at root for the key (size, address). Returns the new root: the
+*             node with the key, or else the last node on its search path (its predecessor or successor)
+*   - Nodes left of the path are hung on a left tree and nodes right of it on a right tree, then both are
+*     reattached under the new root, so no parent links are needed
+*/
+char *tree_splay(char* root, size_t size, char* address){
+    char* left_root = NULL; // Left tree: nodes known to be before the key
+    char* left_max = NULL;
+    char* right_root = NULL; // Right tree: nodes known to be after the key
+    char* right_min = NULL;
+
+    while(root != NULL){
+        if(tree_before(size, address, root)){
+            char* child = tree_left(root);
+            if(child == NULL){
+                break;
+            }
 
-    // If the remaining block is going to be smaller than the minimum block size
-    if(remainder < 32){
-        // set the header and footer of the whole allocated block
-        put(GHA(payload_pointer), pack(old_size, 1));
-        put(GFA(payload_pointer), pack(old_size, 1)); 
-
-        // Check for free pointer
-        if(payload_pointer != free_root){
-            // Jump over fully allocated free block
-            put(old_payload_pred + 8, PtI(old_payload_succ)); // succ
-            if(old_payload_succ != NULL){
-                put(old_payload_succ, PtI(old_payload_pred)); // pred      
+            // Zig-zig: rotate right first
+            if(tree_before(size, address, child)){
+                set_tree_left(root, tree_right(child));
+                set_tree_right(child, root);
+                root = child;
+                if(tree_left(root) == NULL){
+                    break;
+                }
+            }
+
+            // Link right
+            if(right_min == NULL){
+                right_root = root;
+            }else{
+                set_tree_left(right_min, root);
             }
-        }else{ // paylaod_pointer == free_root
-            // Update free root
-            if(old_payload_succ != NULL){
-                put(old_payload_succ, PtI(NULL)); // pred
+            right_min = root;
+            root = tree_left(root);
+        }else if(size != get_size(GHA(root)) || address != root){
+            char* child = tree_right(root);
+            if(child == NULL){
+                break;
             }
-            free_root = old_payload_succ;
-        }
 
-        return old_size;
-    }else{ // Only split if remainder >= 32
-
-        // set the header and footer of the just the allocated block
-        put(GHA(payload_pointer), pack(block_size, 1));
-        put(GFA(payload_pointer), pack(block_size, 1)); 
-
-        // Set header and footer for un-used bytes 
-        put(GHA(next_blk(payload_pointer)), pack(remainder, 0)); 
-        put(GFA(next_blk(payload_pointer)), pack(remainder, 0));     
-
-        // Check for free root
-        if(free_root != NULL){ 
-            // Payload pointer is not the free root
-            if(payload_pointer != free_root){
-                put(next_blk(payload_pointer), PtI(NULL)); // pred
-                put(next_blk(payload_pointer) + 8, PtI(free_root)); // succ
-                put(free_root, PtI(next_blk(payload_pointer))); // pred
-                put((char*)old_payload_pred + 8, PtI(old_payload_succ));
-                if(old_payload_succ != NULL){ 
-                    put(old_payload_succ, PtI(old_payload_pred)); // pred
-                }
-            }else{ 
-                put(next_blk(payload_pointer), PtI(NULL)); // pred
-                put(next_blk(payload_pointer) + 8, PtI(old_payload_succ)); // succ
-                if(old_payload_succ != NULL){
-                    put(old_payload_succ, PtI(next_blk(payload_pointer))); // pred
+            // Zag-zag: rotate left first
+            if(!tree_before(size, address, child) && (size != get_size(GHA(child)) || address != child)){
+                set_tree_right(root, tree_left(child));
+                set_tree_left(child, root);
+                root = child;
+                if(tree_right(root) == NULL){
+                    break;
                 }
             }
-             
-        }else{ // NOTE: 99% sure will never happen
-            put(next_blk(payload_pointer), PtI(NULL)); // pred
-            put(next_blk(payload_pointer) + 8, PtI(NULL)); // pred
+
+            // Link left
+            if(left_max == NULL){
+                left_root = root;
+            }else{
+                set_tree_right(left_max, root);
+            }
+            left_max = root;
+            root = tree_right(root);
+        }else{
+            break;
         }
+    }
 
-        // Update free root
-        free_root = next_blk(payload_pointer);
-        
-        mm_checkheap(__LINE__);
-        
-        return block_size;
+    if(root == NULL){
+        return NULL;
+    }
+
+    // Reassemble
+    if(left_max != NULL){
+        set_tree_right(left_max, tree_left(root));
+        set_tree_left(root, left_root);
+    }
+    if(right_min != NULL){
+        set_tree_left(right_min, tree_right(root));
+        set_tree_right(root, right_root);
     }
-} 
+
+    return root;
+}
 
 /*
-* find_fit: finds the first fit starting from the free_root
+* tree_lower_bound: the first free block in the tree at or after the key (size, address), NULL if there is
+*                   none. Best fit for size is the lower bound of (size, NULL)
 */
-void* find_fit(size_t block_size){
+char *tree_lower_bound(size_t size, char* address){
+    arena->tree_root = tree_splay(arena->tree_root, size, address);
+    char* node = arena->tree_root;
 
-    // Check to see if any blocks have been added to the free list yet
-    if(free_root == NULL){
-        return NULL;
+    // The root is the key itself, its successor or its predecessor
+    if(node == NULL || tree_before(size, address, node) || (size == get_size(GHA(node)) && address == node)){
+        return node;
     }
 
-    // Set the initial successor pointer
-    char* succ = free_root;
-    // size_t tmp_size = 99999999999999;
-    // void* tmp_ptr = NULL;
+    // The successor of the predecessor is the leftmost node of its right subtree
+    node = tree_right(node);
+    while(node != NULL && tree_left(node) != NULL){
+        node = tree_left(node);
+    }
+    return node;
+}
 
-    while(succ != NULL){
-        //get block size
-        size_t size = get_size(GHA(succ));
+/*
+* tree_insert_block: adds a free block to the tree, as the new root
+*/
+void tree_insert_block(char* payload_pointer){
+    size_t size = get_size(GHA(payload_pointer));
+    char* root = tree_splay(arena->tree_root, size, payload_pointer);
+
+    if(root == NULL){
+        set_tree_left(payload_pointer, NULL);
+        set_tree_right(payload_pointer, NULL);
+    }else if(tree_before(size, payload_pointer, root)){
+        set_tree_left(payload_pointer, tree_left(root));
+        set_tree_right(payload_pointer, root);
+        set_tree_left(root, NULL);
+    }else{
+        set_tree_right(payload_pointer, tree_right(root));
+        set_tree_left(payload_pointer, root);
+        set_tree_right(root, NULL);
+    }
+    arena->tree_root = payload_pointer;
+}
 
-        // check if its large enough
-        if(size > block_size){
-            return (void*)succ;
-            // // If it fits it exactly, use it
-            // if(size == block_size){
-            //     return (void*)succ;
-            // }
-            // else{
-            //     if(size < tmp_size){
-            //         tmp_size = size;
-            //         tmp_ptr = succ;
-            //     }
-            // }
-        }
+/*
+* tree_remove_block: takes a free block out of the tree
+*/
+void tree_remove_block(char* payload_pointer){
+    size_t size = get_size(GHA(payload_pointer));
+    char* root = tree_splay(arena->tree_root, size, payload_pointer);
 
-        // go to next free block
-        succ = ItP(get(succ + 8));
+    // The block is the root now, its left subtree's largest node takes its place
+    if(tree_left(root) == NULL){
+        arena->tree_root = tree_right(root);
+    }else{
+        arena->tree_root = tree_splay(tree_left(root), size, payload_pointer);
+        set_tree_right(arena->tree_root, tree_right(root));
     }
+}
 
-    // Will return NULL if no block is found
-    // return (void*)tmp_ptr;
+#ifdef DEBUG
+/*
+* tree_check: checks that the subtree at node holds large free blocks in key order, all after the key
+*             (lo_size, lo_address) and before the key (hi_size, hi_address)
+*/
+bool tree_check(char* node, size_t lo_size, char* lo_address, size_t hi_size, char* hi_address, int lineno){
+    if(node == NULL){
+        return true;
+    }
 
-    // no block found
-    return NULL;
+    size_t size = get_size(GHA(node));
+    if(!in_heap(node) || get_alloc(GHA(node)) || size < TREE_MIN_BLOCK ||
+       (get(GHA(node)) & ~(size_t)(PREV_MINI | PURGED)) != get(GFA(node)) || get_prev_alloc(GHA(next_blk(node)))){
+        dbg_printf("Check heap: tree node %p is not a large free block at line %d\n", node, lineno);
+        return false;
+    }
+
+    if(!tree_before(lo_size, lo_address, node) || !(size < hi_size || (size == hi_size && node < hi_address))){
+        dbg_printf("Check heap: tree node %p is out of key order at line %d\n", node, lineno);
+        return false;
+    }
+
+    return tree_check(tree_left(node), lo_size, lo_address, size, node, lineno) &&
+           tree_check(tree_right(node), size, node, hi_size, hi_address, lineno);
+}
+#endif
+#endif
+
+/*
+* list_sentinel: the sentinel node of size class class, it only has the pred and succ links of a free block
+*/
+char *list_sentinel(size_t class){
+    return arena->sentinels + class * SENTINEL_SIZE;
+}
+
+/*
+* get_pred: returns the predecessor of a free block in its size class
+*/
+char *get_pred(void* payload_pointer){
+    return link_block(((uint32_t*)payload_pointer)[0]);
+}
+
+/*
+* get_succ: returns the successor of a free block in its size class
+*/
+char *get_succ(void* payload_pointer){
+    return link_block(((uint32_t*)payload_pointer)[1]);
+}
+
+/*
+* set_pred: sets the predecessor of a free block (or sentinel) in its size class
+*/
+void set_pred(void* payload_pointer, char* pred){
+    ((uint32_t*)payload_pointer)[0] = block_link(pred);
+}
+
+/*
+* set_succ: sets the successor of a free block (or sentinel) in its size class
+*/
+void set_succ(void* payload_pointer, char* succ){
+    ((uint32_t*)payload_pointer)[1] = block_link(succ);
+}
+
+/*
+* block_link: compresses a block (or sentinel) address into a link, its offset from the arena in 16 byte units
+*/
+uint32_t block_link(char* payload_pointer){
+    return (uint32_t)((PtI(payload_pointer) - PtI(arena)) / ALIGNMENT);
+}
+
+/*
+* link_block: expands a link back into the block address
+*/
+char *link_block(uint32_t link){
+    return (char*)arena + (size_t)link * ALIGNMENT;
 }
 
 /*
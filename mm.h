@@ -21,6 +21,15 @@ extern void *calloc (size_t nmemb, size_t size);
 
 extern bool mm_init(void);
 
+/* Returns the free top of the heap beyond pad bytes to memlib. Returns true if memory was released */
+extern bool mm_trim(size_t pad);
+
+/* Allocates n blocks of size bytes into out[] in one step. Returns the number of blocks allocated */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/* Frees the n blocks in ptrs[] (NULL entries are skipped) in one step. Reorders ptrs[] */
+extern void mm_free_batch(void **ptrs, size_t n);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);
 